@@ -0,0 +1,497 @@
+#include <bench/bench.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define MOUNT_REPS          5
+#define LOOKUP_REPS         200
+#define RANDOM_OPS          2000
+#define RANDOM_IO_SIZE      4096
+#define SEQ_IO_SIZE         (1024 * 1024)
+#define CREATE_COUNT        64
+#define DEEP_LEVELS         24
+#define WIDE_ENTRIES        5000
+#define APPEND_SIZE         (4 * 1024 * 1024)
+#define APPEND_CHUNK        (64 * 1024)
+#define MT_MAX_THREADS      16
+#define MT_OPS              20000
+#define MT_IO_SIZE          512
+#define MT_SPAN             (64 * 1024)     // Small enough to stay in the block cache
+
+typedef struct scenario scenario_t;
+typedef struct mt_worker mt_worker_t;
+
+struct scenario
+{
+    char *name;
+    bench_image_t *(*build) (void);
+    char *data_path;
+    char *lookup_path;
+    char *create_dir;
+};
+
+struct mt_worker
+{
+    pthread_t thread;
+    fat_fs_t *fs;
+    file_t *file;
+    uint32_t span;
+    uint64_t seed;
+};
+
+char *image_dir = NULL;
+uint64_t rand_state = 0x9E3779B97F4A7C15ull;
+
+uint64_t bench_rand_r(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+uint64_t bench_rand(void)
+{
+    return bench_rand_r(&rand_state);
+}
+
+double bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void report(char *scenario, char *metric, double value, char *unit)
+{
+    printf("%s,%s,%.3f,%s\n", scenario, metric, value, unit);
+    fflush(stdout);
+}
+
+bench_image_t *build_small_files(void)
+{
+    bench_image_t *img;
+    uint32_t dir;
+    char name[16];
+
+    img = image_format(48, 8);
+    if (img == NULL)
+        return NULL;
+
+    for (uint32_t d=0; d < 20; d++) {
+        snprintf(name, sizeof(name), "D%02u", d);
+        dir = image_mkdir(img, BENCH_ROOT_CLUSTER, name, 0);
+        for (uint32_t f=0; f < 100; f++) {
+            snprintf(name, sizeof(name), "F%04u.DAT", f);
+            image_add_file(img, dir, name, 512 + (d * 100 + f) * 37 % 7680, 1, f);
+        }
+    }
+    image_mkdir(img, BENCH_ROOT_CLUSTER, "CREATE", CREATE_COUNT);
+
+    return img;
+}
+
+bench_image_t *build_huge_files(void)
+{
+    bench_image_t *img;
+
+    img = image_format(80, 8);
+    if (img == NULL)
+        return NULL;
+
+    image_add_file(img, BENCH_ROOT_CLUSTER, "HUGE0.BIN", 32 << 20, 1, 0);
+    image_add_file(img, BENCH_ROOT_CLUSTER, "HUGE1.BIN", 32 << 20, 1, 1);
+    image_mkdir(img, BENCH_ROOT_CLUSTER, "CREATE", CREATE_COUNT);
+
+    return img;
+}
+
+bench_image_t *build_deep_tree(void)
+{
+    bench_image_t *img;
+    uint32_t dir = BENCH_ROOT_CLUSTER;
+    char name[16];
+
+    img = image_format(16, 1);
+    if (img == NULL)
+        return NULL;
+
+    for (uint32_t d=0; d < DEEP_LEVELS; d++) {
+        snprintf(name, sizeof(name), "D%02u", d);
+        dir = image_mkdir(img, dir, name, 0);
+    }
+    image_add_file(img, dir, "LEAF.TXT", 64 << 10, 1, 7);
+
+    return img;
+}
+
+bench_image_t *build_wide_dir(void)
+{
+    bench_image_t *img;
+    uint32_t dir;
+    char name[16];
+
+    img = image_format(32, 8);
+    if (img == NULL)
+        return NULL;
+
+    dir = image_mkdir(img, BENCH_ROOT_CLUSTER, "WIDE", WIDE_ENTRIES + CREATE_COUNT);
+    for (uint32_t f=0; f < WIDE_ENTRIES; f++) {
+        snprintf(name, sizeof(name), "F%04u.DAT", f);
+        image_add_file(img, dir, name, 512, 1, f);
+    }
+
+    return img;
+}
+
+bench_image_t *build_fragmented(void)
+{
+    bench_image_t *img;
+
+    img = image_format(32, 1);
+    if (img == NULL)
+        return NULL;
+
+    // The second file fills the holes left by the first, interleaving both chains
+    image_add_file(img, BENCH_ROOT_CLUSTER, "FRAG0.BIN", 12 << 20, 2, 0);
+    image_add_file(img, BENCH_ROOT_CLUSTER, "FRAG1.BIN", 12 << 20, 1, 1);
+    image_mkdir(img, BENCH_ROOT_CLUSTER, "CREATE", CREATE_COUNT);
+
+    return img;
+}
+
+char deep_path[DEEP_LEVELS * 4 + 16];
+
+scenario_t scenarios[] = {
+    { "small_files", build_small_files, "/D19/F0099.DAT", "/D10/F0050.DAT", "/CREATE" },
+    { "huge_files", build_huge_files, "/HUGE1.BIN", "/HUGE1.BIN", "/CREATE" },
+    { "deep_tree", build_deep_tree, deep_path, deep_path, NULL },
+    { "wide_dir", build_wide_dir, NULL, "/WIDE/F4999.DAT", "/WIDE" },
+    { "fragmented", build_fragmented, "/FRAG0.BIN", "/FRAG1.BIN", "/CREATE" },
+};
+
+blkdev_t *bench_open_dev(scenario_t *sc, bench_image_t *img, int *fd)
+{
+    char path[512];
+
+    *fd = -1;
+    if (image_dir == NULL)
+        return blkdev_mem_open(img->data, img->size);
+
+    snprintf(path, sizeof(path), "%s/%s.img", image_dir, sc->name);
+    if (image_save(img, path) != 0)
+        return NULL;
+
+    *fd = open(path, O_RDWR);
+    if (*fd < 0) {
+        puts("Bench error: cannot open image file");
+        return NULL;
+    }
+
+    return blkdev_fd_open(*fd);
+}
+
+// Mount latency and its phases, averaged over MOUNT_REPS mounts
+void bench_mount(scenario_t *sc, blkdev_t *dev, char *metric, uint32_t flags)
+{
+    fat_mount_times_t phases = {0};
+    fat_fs_t *fs;
+    char name[64];
+    double start;
+    double total = 0;
+
+    for (int i=0; i < MOUNT_REPS; i++) {
+        start = bench_now();
+        fs = fat_fs_mount_flags(dev, flags);
+        total += bench_now() - start;
+        if (fs == NULL)
+            return;
+        phases.superblock += fs->mount_times.superblock;
+        phases.caches += fs->mount_times.caches;
+        phases.free_space += fs->mount_times.free_space;
+        phases.root += fs->mount_times.root;
+        fat_fs_fini(fs);
+    }
+
+    report(sc->name, metric, total / MOUNT_REPS * 1e3, "ms");
+    snprintf(name, sizeof(name), "%s_superblock", metric);
+    report(sc->name, name, phases.superblock / MOUNT_REPS / 1e6, "ms");
+    snprintf(name, sizeof(name), "%s_caches", metric);
+    report(sc->name, name, phases.caches / MOUNT_REPS / 1e6, "ms");
+    snprintf(name, sizeof(name), "%s_free_space", metric);
+    report(sc->name, name, phases.free_space / MOUNT_REPS / 1e6, "ms");
+    snprintf(name, sizeof(name), "%s_root", metric);
+    report(sc->name, name, phases.root / MOUNT_REPS / 1e6, "ms");
+}
+
+void bench_data(scenario_t *sc, fat_fs_t *fs)
+{
+    file_t *file;
+    uint8_t *buffer;
+    double start;
+    size_t size;
+    uint32_t offset;
+    int fd;
+
+    file = file_open_path(fs, sc->data_path);
+    buffer = malloc(SEQ_IO_SIZE);
+    if (file == NULL || buffer == NULL) {
+        puts("Bench error: cannot open data file");
+        goto exit;
+    }
+    size = file->entry->size;
+
+    start = bench_now();
+    for (offset=0; offset < size; offset += SEQ_IO_SIZE)
+        file_read_into(file, fs, offset, buffer, SEQ_IO_SIZE);
+    report(sc->name, "seq_read", size / (bench_now() - start) / 1e6, "MB/s");
+
+    // Small sequential reads are what readahead is for
+    start = bench_now();
+    for (offset=0; offset < size; offset += RANDOM_IO_SIZE)
+        file_read_into(file, fs, offset, buffer, RANDOM_IO_SIZE);
+    report(sc->name, "seq_read_4k", size / (bench_now() - start) / 1e6, "MB/s");
+
+    // Same stream through a descriptor, its cursor skips the extent map lookups.
+    // A first untimed pass maps the chain, as the passes above did for file
+    fd = fat_open(fs, sc->data_path, FAT_O_RDONLY);
+    while (fd >= 0 && fat_read(fs, fd, buffer, SEQ_IO_SIZE) > 0)
+        ;
+    fat_lseek(fs, fd, 0, SEEK_SET);
+    start = bench_now();
+    while (fd >= 0 && fat_read(fs, fd, buffer, RANDOM_IO_SIZE) > 0)
+        ;
+    report(sc->name, "seq_read_4k_fd", size / (bench_now() - start) / 1e6, "MB/s");
+    fat_close(fs, fd);
+
+    start = bench_now();
+    for (int i=0; i < RANDOM_OPS; i++)
+        file_read_into(file, fs, bench_rand() % size, buffer, RANDOM_IO_SIZE);
+    report(sc->name, "rand_read", RANDOM_OPS * (double) RANDOM_IO_SIZE / (bench_now() - start) / 1e6, "MB/s");
+
+    start = bench_now();
+    for (offset=0; offset < size; offset += SEQ_IO_SIZE)
+        file_write_from(file, fs, offset, buffer, size - offset < SEQ_IO_SIZE ? size - offset : SEQ_IO_SIZE);
+    fat_fs_flush(fs);
+    report(sc->name, "seq_write", size / (bench_now() - start) / 1e6, "MB/s");
+
+    start = bench_now();
+    // Overwrites only, writes past the end would grow the file
+    for (int i=0; i < RANDOM_OPS; i++) {
+        offset = bench_rand() % size;
+        file_write_from(file, fs, offset, buffer, size - offset < RANDOM_IO_SIZE ? size - offset : RANDOM_IO_SIZE);
+    }
+    fat_fs_flush(fs);
+    report(sc->name, "rand_write", RANDOM_OPS * (double) RANDOM_IO_SIZE / (bench_now() - start) / 1e6, "MB/s");
+
+exit:
+    if (file != NULL)
+        file_close(fs, file);
+    free(buffer);
+}
+
+void bench_lookup(scenario_t *sc, fat_fs_t *fs)
+{
+    file_t *file;
+    double start;
+
+    start = bench_now();
+    for (int i=0; i < LOOKUP_REPS; i++) {
+        file = file_open_path(fs, sc->lookup_path);
+        if (file == NULL) {
+            puts("Bench error: lookup failed");
+            return;
+        }
+        file_close(fs, file);
+    }
+    report(sc->name, "lookup", (bench_now() - start) / LOOKUP_REPS * 1e6, "us");
+}
+
+void bench_create_delete(scenario_t *sc, fat_fs_t *fs)
+{
+    char name[16];
+    char path[64];
+    double start;
+
+    start = bench_now();
+    for (int i=0; i < CREATE_COUNT; i++) {
+        snprintf(name, sizeof(name), "N%04d", i);
+        file_create(fs, sc->create_dir, name);
+    }
+    report(sc->name, "create", CREATE_COUNT / (bench_now() - start), "ops/s");
+
+    start = bench_now();
+    for (int i=0; i < CREATE_COUNT; i++) {
+        snprintf(path, sizeof(path), "%s/N%04d", sc->create_dir, i);
+        file_delete(fs, path);
+    }
+    report(sc->name, "delete", CREATE_COUNT / (bench_now() - start), "ops/s");
+}
+
+void bench_append(scenario_t *sc, fat_fs_t *fs)
+{
+    file_t *file;
+    uint8_t *buffer;
+    char path[64];
+    double start;
+
+    snprintf(path, sizeof(path), "%s/LOG.TXT", sc->create_dir);
+    file_create(fs, sc->create_dir, "LOG.TXT");
+    file = file_open_path(fs, path);
+    buffer = calloc(1, APPEND_CHUNK);
+    if (file == NULL || buffer == NULL) {
+        puts("Bench error: cannot open append file");
+        goto exit;
+    }
+
+    start = bench_now();
+    for (uint32_t done=0; done < APPEND_SIZE; done += APPEND_CHUNK)
+        if (file_append(file, fs, buffer, APPEND_CHUNK) != APPEND_CHUNK) {
+            puts("Bench error: append failed");
+            break;
+        }
+    fat_fs_flush(fs);
+    report(sc->name, "append", file->entry->size / (bench_now() - start) / 1e6, "MB/s");
+    report(sc->name, "append_extents", file->map.count, "extents");
+
+exit:
+    if (file != NULL)
+        file_close(fs, file);
+    free(buffer);
+    file_delete(fs, path);
+}
+
+void *mt_reader(void *arg)
+{
+    mt_worker_t *worker = arg;
+    uint8_t buffer[MT_IO_SIZE];
+    uint32_t offset;
+
+    for (int i=0; i < MT_OPS; i++) {
+        offset = bench_rand_r(&worker->seed) % (worker->span / MT_IO_SIZE) * MT_IO_SIZE;
+        file_read_into(worker->file, worker->fs, offset, buffer, MT_IO_SIZE);
+    }
+
+    return NULL;
+}
+
+// Cached random reads from 1 to MT_MAX_THREADS threads, each with its own handle
+void bench_threads(scenario_t *sc, fat_fs_t *fs)
+{
+    mt_worker_t workers[MT_MAX_THREADS];
+    uint8_t buffer[MT_IO_SIZE];
+    char metric[32];
+    double start;
+    int opened;
+
+    for (opened=0; opened < MT_MAX_THREADS; opened++) {
+        workers[opened].fs = fs;
+        workers[opened].file = file_open_path(fs, sc->data_path);
+        if (workers[opened].file == NULL) {
+            puts("Bench error: cannot open data file");
+            goto exit;
+        }
+        workers[opened].span = workers[opened].file->entry->size < MT_SPAN ? workers[opened].file->entry->size : MT_SPAN;
+        workers[opened].seed = 0x9E3779B97F4A7C15ull * (opened + 1);
+    }
+    if (workers[0].span < MT_IO_SIZE)
+        goto exit;
+
+    // Warm the cache so every thread count measures hits only
+    for (uint32_t offset=0; offset < workers[0].span; offset += MT_IO_SIZE)
+        file_read_into(workers[0].file, fs, offset, buffer, MT_IO_SIZE);
+
+    // Scaling past the core count only measures the scheduler
+    report(sc->name, "mt_cores", sysconf(_SC_NPROCESSORS_ONLN), "cores");
+    for (int threads=1; threads <= MT_MAX_THREADS; threads *= 2) {
+        start = bench_now();
+        for (int i=0; i < threads; i++)
+            pthread_create(&workers[i].thread, NULL, mt_reader, &workers[i]);
+        for (int i=0; i < threads; i++)
+            pthread_join(workers[i].thread, NULL);
+
+        snprintf(metric, sizeof(metric), "mt_rand_read_%dt", threads);
+        report(sc->name, metric, threads * (double) MT_OPS / (bench_now() - start), "ops/s");
+    }
+
+exit:
+    while (opened-- > 0)
+        file_close(fs, workers[opened].file);
+}
+
+void bench_run(scenario_t *sc)
+{
+    bench_image_t *img;
+    blkdev_t *dev;
+    fat_fs_t *fs;
+    int fd;
+
+    img = sc->build();
+    if (img == NULL)
+        return;
+    image_finish(img);
+
+    dev = bench_open_dev(sc, img, &fd);
+    if (dev == NULL)
+        goto exit;
+
+    bench_mount(sc, dev, "mount", 0);
+    bench_mount(sc, dev, "mount_fast", FS_MOUNT_FAST);
+
+    fs = fat_fs_mount(dev);
+    if (fs == NULL) {
+        puts("Bench error: failed to mount image");
+        goto close;
+    }
+    if (sc->lookup_path != NULL)
+        bench_lookup(sc, fs);
+    if (sc->data_path != NULL) {
+        bench_data(sc, fs);
+        bench_threads(sc, fs);
+    }
+    if (sc->create_dir != NULL) {
+        bench_create_delete(sc, fs);
+        bench_append(sc, fs);
+    }
+    fat_fs_fini(fs);
+
+close:
+    blkdev_close(dev);
+    if (fd >= 0)
+        close(fd);
+exit:
+    image_destroy(img);
+}
+
+int main(int argc, char **argv)
+{
+    char *only = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:s:")) != -1) {
+        if (opt == 'd')
+            image_dir = optarg;
+        else if (opt == 's')
+            only = optarg;
+        else {
+            printf("Usage: %s [-d image_dir] [-s scenario]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    deep_path[0] = '\0';
+    for (int d=0; d < DEEP_LEVELS; d++)
+        snprintf(deep_path + strlen(deep_path), sizeof(deep_path) - strlen(deep_path), "/D%02d", d);
+    strcat(deep_path, "/LEAF.TXT");
+
+    puts("scenario,metric,value,unit");
+    for (size_t i=0; i < sizeof(scenarios) / sizeof(*scenarios); i++)
+        if (only == NULL || !strcmp(only, scenarios[i].name))
+            bench_run(&scenarios[i]);
+
+    return 0;
+}
@@ -0,0 +1,34 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <include/fat.h>
+
+#define BENCH_SECTOR_SIZE       512
+#define BENCH_RESERVED          32
+#define BENCH_FAT_COUNT         2
+#define BENCH_FSINFO_SECTOR     1
+#define BENCH_ROOT_CLUSTER      2
+
+typedef struct bench_image bench_image_t;
+
+// FAT32 image built in memory, independent from the library under test
+struct bench_image
+{
+    uint8_t *data;
+    uint64_t size;
+    uint32_t cluster_size;
+    uint32_t fat_size;
+    uint32_t data_region;
+    uint32_t cluster_count;
+    uint32_t next_free;
+};
+
+// bench/image.c
+bench_image_t *image_format(uint32_t size_mb, uint32_t cluster_size);
+uint32_t image_mkdir(bench_image_t *img, uint32_t parent, char *name, uint32_t slots);
+uint32_t image_add_file(bench_image_t *img, uint32_t parent, char *name, uint32_t size, uint32_t stride, uint32_t seed);
+void image_finish(bench_image_t *img);
+uint8_t image_save(bench_image_t *img, char *path);
+void image_destroy(bench_image_t *img);
+
+#endif
@@ -0,0 +1,252 @@
+#include <bench/bench.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ENTRY_SIZE      32
+
+void put_word(uint8_t *buffer, uint32_t offset, uint16_t value)
+{
+    buffer[offset] = value;
+    buffer[offset + 1] = value >> 8;
+}
+
+void put_long(uint8_t *buffer, uint32_t offset, uint32_t value)
+{
+    put_word(buffer, offset, value);
+    put_word(buffer, offset + 2, value >> 16);
+}
+
+uint32_t image_fat_get(bench_image_t *img, uint32_t cluster)
+{
+    return BYTES_TO_LONG(img->data, BENCH_RESERVED * BENCH_SECTOR_SIZE + cluster * 4) & FAT_ENTRY_MASK;
+}
+
+void image_fat_set(bench_image_t *img, uint32_t cluster, uint32_t value)
+{
+    put_long(img->data, BENCH_RESERVED * BENCH_SECTOR_SIZE + cluster * 4, value);
+}
+
+uint8_t *image_cluster(bench_image_t *img, uint32_t cluster)
+{
+    return img->data + (uint64_t) (img->data_region + (cluster - 2) * img->cluster_size) * BENCH_SECTOR_SIZE;
+}
+
+bench_image_t *image_format(uint32_t size_mb, uint32_t cluster_size)
+{
+    bench_image_t *img;
+    uint32_t sectors;
+    uint8_t *bpb;
+    uint8_t *fsinfo;
+
+    img = calloc(1, sizeof(*img));
+    if (img == NULL) {
+        puts("Malloc error: not enough space to allocate bench image");
+        return NULL;
+    }
+
+    sectors = size_mb * (1024 * 1024 / BENCH_SECTOR_SIZE);
+    img->size = (uint64_t) sectors * BENCH_SECTOR_SIZE;
+    img->data = calloc(1, img->size);
+    if (img->data == NULL) {
+        puts("Malloc error: not enough space to allocate bench image data");
+        free(img);
+        return NULL;
+    }
+
+    img->cluster_size = cluster_size;
+    img->fat_size = ((sectors - BENCH_RESERVED) / cluster_size * 4 + BENCH_SECTOR_SIZE - 1) / BENCH_SECTOR_SIZE + 1;
+    img->data_region = BENCH_RESERVED + BENCH_FAT_COUNT * img->fat_size;
+    img->cluster_count = (sectors - img->data_region) / cluster_size;
+    img->next_free = BENCH_ROOT_CLUSTER + 1;
+
+    bpb = img->data;
+    memcpy(bpb, "\xEB\x58\x90MSWIN4.1", 11);
+    put_word(bpb, BYTES_PER_SECTOR, BENCH_SECTOR_SIZE);
+    bpb[SECTOR_PER_CLUSTER] = cluster_size;
+    put_word(bpb, RESERVED_SECTORS, BENCH_RESERVED);
+    bpb[FAT_TABLE_COUNT] = BENCH_FAT_COUNT;
+    bpb[0x15] = 0xF8;
+    put_long(bpb, LARGE_SECTOR_COUNT, sectors);
+    put_long(bpb, FAT_TABLE_SIZE, img->fat_size);
+    put_long(bpb, ROOT_CLUSTER, BENCH_ROOT_CLUSTER);
+    put_word(bpb, FSINFO_SECTOR, BENCH_FSINFO_SECTOR);
+    memcpy(bpb + 0x52, "FAT32   ", 8);
+    put_word(bpb, 510, 0xAA55);
+
+    fsinfo = img->data + BENCH_FSINFO_SECTOR * BENCH_SECTOR_SIZE;
+    put_long(fsinfo, LEAD_SIGNATURE1_OFF, LEAD_SIGNATURE1);
+    put_long(fsinfo, LEAD_SIGNATURE2_OFF, LEAD_SIGNATURE2);
+    put_word(fsinfo, 510, 0xAA55);
+
+    image_fat_set(img, 0, 0x0FFFFFF8);
+    image_fat_set(img, 1, EOC2);
+    image_fat_set(img, BENCH_ROOT_CLUSTER, EOC2);
+
+    return img;
+}
+
+// Take n free clusters, skipping stride - 1 free clusters between two of them
+uint32_t image_alloc_chain(bench_image_t *img, uint32_t n, uint32_t stride)
+{
+    uint32_t first = 0;
+    uint32_t prev = 0;
+    uint32_t cluster = img->next_free;
+    uint32_t skip = 0;
+
+    while (n > 0 && cluster < img->cluster_count + 2) {
+        if (image_fat_get(img, cluster) == 0 && skip-- == 0) {
+            if (prev != 0)
+                image_fat_set(img, prev, cluster);
+            else
+                first = cluster;
+            image_fat_set(img, cluster, EOC2);
+            prev = cluster;
+            skip = stride - 1;
+            n--;
+        }
+        cluster++;
+    }
+
+    while (img->next_free < img->cluster_count + 2 && image_fat_get(img, img->next_free) != 0)
+        img->next_free++;
+
+    return n == 0 ? first : 0;
+}
+
+void image_fill_name(uint8_t *entry, char *name)
+{
+    size_t i;
+    char *dot;
+
+    memset(entry, ' ', SHORT_NAME_LEN);
+    dot = strchr(name, '.');
+    for (i=0; i < FILENAME_LEN && name[i] && name + i != dot; i++)
+        entry[i] = name[i];
+    if (dot != NULL)
+        for (i=0; i < FILE_EXT_LEN && dot[i + 1]; i++)
+            entry[FILENAME_LEN + i] = dot[i + 1];
+}
+
+// Append a directory entry, growing the parent chain when it is full
+uint8_t image_add_entry(bench_image_t *img, uint32_t parent, char *name, uint8_t attr, uint32_t cluster, uint32_t size)
+{
+    uint32_t cluster_sizeb = img->cluster_size * BENCH_SECTOR_SIZE;
+    uint8_t *entry = NULL;
+    uint8_t *data;
+    uint32_t next;
+
+    while (entry == NULL) {
+        data = image_cluster(img, parent);
+        for (uint32_t off=0; off < cluster_sizeb && entry == NULL; off += ENTRY_SIZE)
+            if (data[off] == 0)
+                entry = data + off;
+        if (entry != NULL)
+            break;
+
+        next = image_fat_get(img, parent);
+        if (next >= EOC1) {
+            next = image_alloc_chain(img, 1, 1);
+            if (next == 0)
+                return FS_ERROR;
+            image_fat_set(img, parent, next);
+            memset(image_cluster(img, next), 0, cluster_sizeb);
+        }
+        parent = next;
+    }
+
+    image_fill_name(entry, name);
+    entry[ATTR_OFFSET] = attr;
+    put_word(entry, HIGH_CLUSTER_OFFSET, cluster >> 16);
+    put_word(entry, LOW_CLUSTER_OFFSET, cluster & 0xFFFF);
+    put_long(entry, SIZE_OFFSET, size);
+
+    return 0;
+}
+
+// Directory chain is preallocated to hold at least slots entries
+uint32_t image_mkdir(bench_image_t *img, uint32_t parent, char *name, uint32_t slots)
+{
+    uint32_t cluster_sizeb = img->cluster_size * BENCH_SECTOR_SIZE;
+    uint32_t cluster;
+    uint32_t curr;
+    uint32_t n;
+
+    n = (slots * ENTRY_SIZE + cluster_sizeb - 1) / cluster_sizeb;
+    cluster = image_alloc_chain(img, n ? n : 1, 1);
+    if (cluster == 0)
+        return 0;
+
+    for (curr = cluster; curr < EOC1; curr = image_fat_get(img, curr))
+        memset(image_cluster(img, curr), 0, cluster_sizeb);
+    if (image_add_entry(img, parent, name, DIR_ATTR, cluster, 0) != 0)
+        return 0;
+
+    return cluster;
+}
+
+uint32_t image_add_file(bench_image_t *img, uint32_t parent, char *name, uint32_t size, uint32_t stride, uint32_t seed)
+{
+    uint32_t cluster_sizeb = img->cluster_size * BENCH_SECTOR_SIZE;
+    uint32_t first;
+    uint32_t cluster;
+    uint8_t *data;
+
+    first = image_alloc_chain(img, size ? (size + cluster_sizeb - 1) / cluster_sizeb : 1, stride);
+    if (first == 0)
+        return 0;
+
+    // Content is a pure function of seed and offset so every run sees the same bytes
+    cluster = first;
+    for (uint32_t off=0; off < size; off += cluster_sizeb) {
+        data = image_cluster(img, cluster);
+        for (uint32_t i=0; i < cluster_sizeb; i++)
+            data[i] = (off + i) * 31 + seed;
+        cluster = image_fat_get(img, cluster);
+    }
+
+    if (image_add_entry(img, parent, name, FILE_ATTR, first, size) != 0)
+        return 0;
+
+    return first;
+}
+
+// Mirror the FAT and record the exact free count in FSInfo
+void image_finish(bench_image_t *img)
+{
+    uint8_t *fat = img->data + BENCH_RESERVED * BENCH_SECTOR_SIZE;
+    uint8_t *fsinfo = img->data + BENCH_FSINFO_SECTOR * BENCH_SECTOR_SIZE;
+    uint32_t free_count = 0;
+
+    for (uint32_t i=2; i < img->cluster_count + 2; i++)
+        if (image_fat_get(img, i) == 0)
+            free_count++;
+
+    for (uint32_t i=1; i < BENCH_FAT_COUNT; i++)
+        memcpy(fat + i * img->fat_size * BENCH_SECTOR_SIZE, fat, img->fat_size * BENCH_SECTOR_SIZE);
+
+    put_long(fsinfo, FREE_CLUSTER_COUNT, free_count);
+    put_long(fsinfo, FREE_CLUSTER, img->next_free);
+}
+
+uint8_t image_save(bench_image_t *img, char *path)
+{
+    FILE *out;
+    size_t written;
+
+    out = fopen(path, "w");
+    if (out == NULL) {
+        puts("Bench error: cannot create image file");
+        return FS_ERROR;
+    }
+
+    written = fwrite(img->data, 1, img->size, out);
+    fclose(out);
+
+    return written == img->size ? 0 : FS_ERROR;
+}
+
+void image_destroy(bench_image_t *img)
+{
+    free(img->data);
+    free(img);
+}
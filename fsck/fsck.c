@@ -0,0 +1,593 @@
+#include <include/fat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#define FSCK_MAX_THREADS    64
+#define FSCK_PATH_LEN       256
+#define FSCK_BAD_CLUSTER    0x0FFFFFF7
+#define WORD_BITS           64
+
+#define FSCK_CLEAN          0
+#define FSCK_FOUND          1
+#define FSCK_FAILED         2
+
+typedef struct fsck fsck_t;
+typedef struct fsck_dir fsck_dir_t;
+typedef struct fsck_fix fsck_fix_t;
+typedef struct fsck_worker fsck_worker_t;
+
+// Directory waiting for a worker
+struct fsck_dir
+{
+    uint32_t cluster;
+    uint32_t len;           // Clusters of the chain that are safe to read
+    char path[FSCK_PATH_LEN];
+    fsck_dir_t *next;
+};
+
+// Entry whose chain is cut or too short for its size, repaired once the walk is over
+struct fsck_fix
+{
+    uint32_t parent;
+    entry_t entry;
+    uint32_t len;           // Clusters claimed by the chain
+    uint32_t last;          // Last of them
+    uint8_t broken;         // Chain ended on a claimed, free or invalid cluster
+    fsck_fix_t *next;
+};
+
+struct fsck
+{
+    fat_fs_t *fs;
+    uint8_t repair;
+    int threads;
+    uint8_t *fat;           // Snapshot of the first FAT, read once
+    uint32_t cluster_max;
+    uint64_t *owned;        // Set by the first chain that reaches a cluster
+    uint64_t *pointed;      // Lost clusters some other lost cluster links to
+    pthread_mutex_t lock;   // Directory queue and fix list
+    pthread_cond_t work;
+    fsck_dir_t *queue;
+    int busy;
+    fsck_fix_t *fixes;
+    uint32_t cross_links;
+    uint32_t bad_chains;
+    uint32_t size_mismatches;
+    uint32_t lost_chains;
+    uint32_t lost_clusters;
+    uint32_t free_clusters;
+    uint32_t partial_dirs;  // Directories only walked in part, their lost entries look lost
+    uint32_t root_cut;      // Last intact cluster of a broken root chain, 0 if whole
+};
+
+struct fsck_worker
+{
+    fsck_t *ck;
+    int index;
+    pthread_t thread;
+};
+
+uint32_t fsck_next(fsck_t *ck, uint32_t cluster)
+{
+    return BYTES_TO_LONG(ck->fat, cluster * sizeof(uint32_t)) & FAT_ENTRY_MASK;
+}
+
+uint8_t fsck_test(uint64_t *bits, uint32_t cluster)
+{
+    return (__atomic_load_n(&bits[cluster / WORD_BITS], __ATOMIC_RELAXED) >> (cluster % WORD_BITS)) & 1;
+}
+
+// Atomically set the bit of cluster, returns whether it was already set
+uint8_t fsck_claim(uint64_t *bits, uint32_t cluster)
+{
+    uint64_t mask = (uint64_t) 1 << (cluster % WORD_BITS);
+
+    return (__atomic_fetch_or(&bits[cluster / WORD_BITS], mask, __ATOMIC_RELAXED) & mask) != 0;
+}
+
+// Slice [*from, *to) of [lo, hi) handled by worker index
+void fsck_slice(fsck_t *ck, int index, uint32_t lo, uint32_t hi, uint32_t *from, uint32_t *to)
+{
+    uint32_t step = (hi - lo + ck->threads - 1) / ck->threads;
+
+    *from = lo + index * step < hi ? lo + index * step : hi;
+    *to = *from + step < hi ? *from + step : hi;
+}
+
+// Run fn on every worker and wait for all of them
+void fsck_parallel(fsck_t *ck, void *(*fn)(void *))
+{
+    fsck_worker_t workers[FSCK_MAX_THREADS];
+    int started;
+
+    for (started=0; started < ck->threads; started++) {
+        workers[started].ck = ck;
+        workers[started].index = started;
+        if (pthread_create(&workers[started].thread, NULL, fn, &workers[started]) != 0)
+            break;
+    }
+
+    // Slices of workers that could not start are done here
+    for (int i=started; i < ck->threads; i++) {
+        workers[i].ck = ck;
+        workers[i].index = i;
+        fn(&workers[i]);
+    }
+    for (int i=0; i < started; i++)
+        pthread_join(workers[i].thread, NULL);
+}
+
+void *fsck_load_fat(void *arg)
+{
+    fsck_worker_t *worker = arg;
+    fsck_t *ck = worker->ck;
+    fat_fs_t *fs = ck->fs;
+    uint32_t from;
+    uint32_t to;
+
+    fsck_slice(ck, worker->index, 0, fs->table->size, &from, &to);
+    if (from < to && read_sectors_into(fs, fs->table->address + from, to - from,
+                                       ck->fat + (size_t) from * fs->volume->sector_size) != 0)
+        printf("%u: FAT sectors %u-%u unreadable\n", worker->index, from, to - 1);
+
+    return NULL;
+}
+
+// "NAME    EXT" as NAME.EXT
+void fsck_name(entry_t *entry, char *name)
+{
+    int n = 0;
+
+    for (int i=0; i < FILENAME_LEN && entry->short_name[i] != ' '; i++)
+        name[n++] = entry->short_name[i];
+    if (entry->short_name[FILENAME_LEN] != ' ')
+        name[n++] = '.';
+    for (int i=FILENAME_LEN; i < SHORT_NAME_LEN && entry->short_name[i] != ' '; i++)
+        name[n++] = entry->short_name[i];
+    name[n] = '\0';
+}
+
+// Claim the chain from first, its length up to the first cluster that cannot belong to it
+uint32_t fsck_walk_chain(fsck_t *ck, uint32_t first, char *path, uint32_t *last, uint8_t *broken)
+{
+    uint32_t cluster = first;
+    uint32_t len = 0;
+    uint32_t next;
+
+    *last = 0;
+    *broken = 1;
+    for (;;) {
+        if (cluster < 2 || cluster >= ck->cluster_max) {
+            printf("%s: chain points outside the volume at cluster %u\n", path, cluster);
+            __atomic_fetch_add(&ck->bad_chains, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        if (fsck_claim(ck->owned, cluster)) {
+            printf("%s: cross-linked or looping at cluster %u\n", path, cluster);
+            __atomic_fetch_add(&ck->cross_links, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        *last = cluster;
+        len++;
+
+        next = fsck_next(ck, cluster);
+        if (next >= EOC1) {
+            *broken = 0;
+            break;
+        }
+        if (next == 0 || next == FSCK_BAD_CLUSTER) {
+            printf("%s: chain runs into a %s cluster after %u\n", path, next == 0 ? "free" : "bad", cluster);
+            __atomic_fetch_add(&ck->bad_chains, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        cluster = next;
+    }
+
+    return len;
+}
+
+void fsck_push_dir(fsck_t *ck, uint32_t cluster, uint32_t len, uint8_t broken, char *path)
+{
+    fsck_dir_t *item;
+
+    if (broken)
+        __atomic_fetch_add(&ck->partial_dirs, 1, __ATOMIC_RELAXED);
+
+    item = malloc(sizeof(*item));
+    if (item == NULL) {
+        puts("Malloc error: not enough space to queue directory");
+        __atomic_fetch_add(&ck->partial_dirs, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    item->cluster = cluster;
+    item->len = len;
+    strncpy(item->path, path, FSCK_PATH_LEN - 1);
+    item->path[FSCK_PATH_LEN - 1] = '\0';
+
+    pthread_mutex_lock(&ck->lock);
+    item->next = ck->queue;
+    ck->queue = item;
+    pthread_cond_signal(&ck->work);
+    pthread_mutex_unlock(&ck->lock);
+}
+
+void fsck_push_fix(fsck_t *ck, uint32_t parent, entry_t *entry, uint32_t len, uint32_t last, uint8_t broken)
+{
+    fsck_fix_t *fix;
+
+    fix = malloc(sizeof(*fix));
+    if (fix == NULL) {
+        puts("Malloc error: not enough space to record repair");
+        return;
+    }
+    fix->parent = parent;
+    memcpy(&fix->entry, entry, sizeof(fix->entry));
+    fix->len = len;
+    fix->last = last;
+    fix->broken = broken;
+
+    pthread_mutex_lock(&ck->lock);
+    fix->next = ck->fixes;
+    ck->fixes = fix;
+    pthread_mutex_unlock(&ck->lock);
+}
+
+void fsck_check_entry(fsck_t *ck, fsck_dir_t *parent, entry_t *entry)
+{
+    size_t cluster_sizeb = ck->fs->volume->cluster_sizeb;
+    char path[FSCK_PATH_LEN + SHORT_NAME_LEN + 2];
+    char name[SHORT_NAME_LEN + 2];
+    uint32_t first;
+    uint32_t need;
+    uint32_t len = 0;
+    uint32_t last = 0;
+    uint8_t broken = 0;
+
+    fsck_name(entry, name);
+    // Deeper paths are only cut short in the report
+    if (snprintf(path, sizeof(path), "%s/%s", parent->path, name) < 0)
+        path[0] = '\0';
+    first = WORDS_TO_LONG(entry->high_cluster, entry->low_cluster);
+    if (first != 0)
+        len = fsck_walk_chain(ck, first, path, &last, &broken);
+
+    if (entry->attr & DIR_ATTR) {
+        if (first == 0) {
+            printf("%s: directory without clusters\n", path);
+            __atomic_fetch_add(&ck->bad_chains, 1, __ATOMIC_RELAXED);
+        } else if (len > 0)
+            fsck_push_dir(ck, first, len, broken, path);
+        else
+            __atomic_fetch_add(&ck->partial_dirs, 1, __ATOMIC_RELAXED);
+        if (broken && ck->repair)
+            fsck_push_fix(ck, parent->cluster, entry, len, last, broken);
+        return;
+    }
+
+    // Clusters past the size are preallocated (FILE_ALLOC_KEEP_SIZE), only a short chain is damage
+    need = (entry->size + cluster_sizeb - 1) / cluster_sizeb;
+    if (!broken && len < need) {
+        printf("%s: size %u needs %u clusters, chain has %u\n", path, entry->size, need, len);
+        __atomic_fetch_add(&ck->size_mismatches, 1, __ATOMIC_RELAXED);
+    }
+    if (ck->repair && (broken || len < need))
+        fsck_push_fix(ck, parent->cluster, entry, len, last, broken);
+}
+
+void fsck_walk_dir(fsck_t *ck, fsck_dir_t *item)
+{
+    fat_fs_t *fs = ck->fs;
+    entry_t *dir_entry;
+    entry_t *entry;
+    dir_t *dir;
+
+    dir_entry = fake_entry_create(item->cluster, "", 0);
+    if (dir_entry == NULL)
+        return;
+    dir = dir_init(fs, dir_entry);
+    if (dir == NULL) {
+        free(dir_entry);
+        __atomic_fetch_add(&ck->partial_dirs, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    // Only the intact prefix of a broken chain is read
+    if (dir->ident->entry->size > (size_t) item->len * fs->volume->cluster_sizeb)
+        dir->ident->entry->size = item->len * fs->volume->cluster_sizeb;
+
+    dir_scan(fs, dir);
+    for (size_t i=0; i < dir->used_entries; i++) {
+        entry = &dir->entries[i];
+        // Dot entries point back up the tree, the volume label owns no clusters
+        if (entry->short_name[0] == '.' || (entry->attr & VOLUME_ATTR))
+            continue;
+        fsck_check_entry(ck, item, entry);
+    }
+
+    dir_close(fs, dir);
+}
+
+void *fsck_walk_worker(void *arg)
+{
+    fsck_worker_t *worker = arg;
+    fsck_t *ck = worker->ck;
+    fsck_dir_t *item;
+
+    pthread_mutex_lock(&ck->lock);
+    for (;;) {
+        // Done once the queue is empty and nobody can add to it anymore
+        while (ck->queue == NULL && ck->busy > 0)
+            pthread_cond_wait(&ck->work, &ck->lock);
+        if (ck->queue == NULL)
+            break;
+
+        item = ck->queue;
+        ck->queue = item->next;
+        ck->busy++;
+        pthread_mutex_unlock(&ck->lock);
+
+        fsck_walk_dir(ck, item);
+        free(item);
+
+        pthread_mutex_lock(&ck->lock);
+        if (--ck->busy == 0 && ck->queue == NULL)
+            pthread_cond_broadcast(&ck->work);
+    }
+    pthread_mutex_unlock(&ck->lock);
+
+    return NULL;
+}
+
+// Allocated clusters no chain reached, and which of them other lost clusters link to
+void *fsck_lost_worker(void *arg)
+{
+    fsck_worker_t *worker = arg;
+    fsck_t *ck = worker->ck;
+    uint32_t lost = 0;
+    uint32_t from;
+    uint32_t to;
+    uint32_t next;
+
+    fsck_slice(ck, worker->index, 2, ck->cluster_max, &from, &to);
+    for (uint32_t cluster=from; cluster < to; cluster++) {
+        next = fsck_next(ck, cluster);
+        if (next == 0 || next == FSCK_BAD_CLUSTER || fsck_test(ck->owned, cluster))
+            continue;
+        lost++;
+        if (next >= 2 && next < ck->cluster_max && !fsck_test(ck->owned, next))
+            fsck_claim(ck->pointed, next);
+    }
+    __atomic_fetch_add(&ck->lost_clusters, lost, __ATOMIC_RELAXED);
+
+    return NULL;
+}
+
+void *fsck_head_worker(void *arg)
+{
+    fsck_worker_t *worker = arg;
+    fsck_t *ck = worker->ck;
+    uint32_t heads = 0;
+    uint32_t from;
+    uint32_t to;
+    uint32_t next;
+
+    fsck_slice(ck, worker->index, 2, ck->cluster_max, &from, &to);
+    for (uint32_t cluster=from; cluster < to; cluster++) {
+        next = fsck_next(ck, cluster);
+        if (next != 0 && next != FSCK_BAD_CLUSTER &&
+            !fsck_test(ck->owned, cluster) && !fsck_test(ck->pointed, cluster))
+            heads++;
+    }
+    __atomic_fetch_add(&ck->lost_chains, heads, __ATOMIC_RELAXED);
+
+    return NULL;
+}
+
+// fs->lock held exclusively. Cut broken chains, then shrink sizes the chain cannot hold
+void fsck_apply_fix(fsck_t *ck, fsck_fix_t *fix)
+{
+    fat_fs_t *fs = ck->fs;
+    size_t cluster_sizeb = fs->volume->cluster_sizeb;
+    entry_t *entry = &fix->entry;
+    entry_t *dir_entry;
+    uint32_t first = WORDS_TO_LONG(entry->high_cluster, entry->low_cluster);
+    uint32_t need;
+    dir_t *dir;
+
+    if (fix->broken && fix->len > 0)
+        fat_table_write(fs, fix->last, EOC1);
+    if (fix->len == 0)
+        first = 0;
+
+    // A tail past the size is kept as preallocation
+    if (!(entry->attr & DIR_ATTR)) {
+        need = (entry->size + cluster_sizeb - 1) / cluster_sizeb;
+        if (need > fix->len)
+            entry->size = fix->len * cluster_sizeb;
+    }
+
+    entry->low_cluster = first & 0xFFFF;
+    entry->high_cluster = first >> 16;
+
+    dir_entry = fake_entry_create(fix->parent, "", 0);
+    if (dir_entry == NULL)
+        return;
+    dir = dir_init(fs, dir_entry);
+    if (dir == NULL) {
+        free(dir_entry);
+        return;
+    }
+    dir_entry_override(fs, dir, entry->short_name, entry);
+    dir_close(fs, dir);
+}
+
+void fsck_repair(fsck_t *ck)
+{
+    fat_fs_t *fs = ck->fs;
+    fsck_fix_t *fix;
+
+    fat_fs_lock_write(fs);
+    // The bitmap keeps the free count exact through the repairs
+    if (fs->table->bitmap == NULL)
+        fat_table_bitmap_load(fs);
+
+    for (fix=ck->fixes; fix != NULL; fix=fix->next)
+        fsck_apply_fix(ck, fix);
+    if (ck->root_cut != 0)
+        fat_table_write(fs, ck->root_cut, EOC1);
+
+    // Clusters of entries in unwalked directory parts only look lost, keep them all
+    if (ck->partial_dirs > 0 && ck->lost_clusters > 0)
+        printf("%u directories not fully walked, lost clusters left allocated\n", ck->partial_dirs);
+    for (uint32_t cluster=2; ck->partial_dirs == 0 && ck->lost_clusters > 0 && cluster < ck->cluster_max; cluster++) {
+        if (fsck_next(ck, cluster) != 0 && fsck_next(ck, cluster) != FSCK_BAD_CLUSTER &&
+            !fsck_test(ck->owned, cluster))
+            fat_table_write(fs, cluster, 0);
+    }
+
+    if (fs->table->bitmap != NULL)
+        fs->info.free_cluster_count = fs->table->bitmap->free_count;
+    fat_fs_unlock(fs);
+}
+
+int fsck_run(fsck_t *ck)
+{
+    fat_fs_t *fs = ck->fs;
+    uint32_t per_sector = fs->volume->sector_size / sizeof(uint32_t);
+    size_t words;
+    uint32_t hint;
+    uint32_t len;
+    uint32_t last;
+    uint8_t broken;
+    int status = FSCK_CLEAN;
+
+    ck->cluster_max = fs->volume->cluster_count + 2;
+    if (ck->cluster_max > fs->table->size * per_sector)
+        ck->cluster_max = fs->table->size * per_sector;
+    words = (ck->cluster_max + WORD_BITS - 1) / WORD_BITS;
+
+    ck->fat = malloc(fs->table->size * fs->volume->sector_size);
+    ck->owned = calloc(words, sizeof(*ck->owned));
+    ck->pointed = calloc(words, sizeof(*ck->pointed));
+    if (ck->fat == NULL || ck->owned == NULL || ck->pointed == NULL) {
+        puts("Malloc error: not enough space to allocate checker state");
+        return FSCK_FAILED;
+    }
+
+    fsck_parallel(ck, fsck_load_fat);
+
+    // The root chain is claimed first, its directories are spread over the workers.
+    // A damaged root is still walked up to the break
+    len = fsck_walk_chain(ck, fs->info.root_cluster, "/", &last, &broken);
+    if (broken) {
+        printf("/: root directory chain is damaged, walking its first %u clusters\n", len);
+        ck->root_cut = last;
+    }
+    if (len > 0)
+        fsck_push_dir(ck, fs->info.root_cluster, len, broken, "");
+    else
+        ck->partial_dirs++;
+    fsck_parallel(ck, fsck_walk_worker);
+
+    fsck_parallel(ck, fsck_lost_worker);
+    if (ck->lost_clusters > 0) {
+        fsck_parallel(ck, fsck_head_worker);
+        printf("%u lost clusters in %u chains\n", ck->lost_clusters, ck->lost_chains);
+    }
+
+    ck->free_clusters = fat_scan_count(ck->fat, 2, ck->cluster_max);
+    hint = BYTES_TO_LONG(fs->info.buffer, FREE_CLUSTER_COUNT);
+    if (hint != UNKNOWN_FREE_CLUSTER && hint != ck->free_clusters) {
+        printf("FSInfo free count %u, FAT has %u free clusters\n", hint, ck->free_clusters);
+        status = FSCK_FOUND;
+    }
+    hint = BYTES_TO_LONG(fs->info.buffer, FREE_CLUSTER);
+    if (hint != UNKNOWN_FREE_CLUSTER && (hint < 2 || hint >= ck->cluster_max)) {
+        printf("FSInfo next free cluster %u is outside the volume\n", hint);
+        status = FSCK_FOUND;
+    }
+
+    if (ck->cross_links + ck->bad_chains + ck->size_mismatches + ck->lost_clusters > 0)
+        status = FSCK_FOUND;
+    if (status == FSCK_FOUND && ck->repair)
+        fsck_repair(ck);
+
+    return status;
+}
+
+int main(int argc, char **argv)
+{
+    fsck_t ck = {0};
+    fsck_fix_t *fix;
+    blkdev_t *dev;
+    int opt;
+    int fd;
+    int status;
+
+    ck.threads = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt(argc, argv, "rj:")) != -1) {
+        if (opt == 'r')
+            ck.repair = 1;
+        else if (opt == 'j')
+            ck.threads = atoi(optarg);
+        else {
+            printf("Usage: %s [-r] [-j threads] image\n", argv[0]);
+            return FSCK_FAILED;
+        }
+    }
+    if (optind >= argc) {
+        printf("Usage: %s [-r] [-j threads] image\n", argv[0]);
+        return FSCK_FAILED;
+    }
+    if (ck.threads < 1)
+        ck.threads = 1;
+    if (ck.threads > FSCK_MAX_THREADS)
+        ck.threads = FSCK_MAX_THREADS;
+
+    // Without -r the image is opened read only and nothing is written
+    fd = open(argv[optind], ck.repair ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        puts("Fsck error: cannot open image");
+        return FSCK_FAILED;
+    }
+    dev = blkdev_fd_open(fd);
+    ck.fs = dev != NULL ? fat_fs_mount_flags(dev, FS_MOUNT_FAST) : NULL;
+    if (ck.fs == NULL) {
+        puts("Fsck error: cannot mount image");
+        if (dev != NULL)
+            blkdev_close(dev);
+        close(fd);
+        return FSCK_FAILED;
+    }
+    pthread_mutex_init(&ck.lock, NULL);
+    pthread_cond_init(&ck.work, NULL);
+
+    status = fsck_run(&ck);
+    printf("%u cross-links, %u broken chains, %u size mismatches, %u lost clusters, %u free clusters\n",
+           ck.cross_links, ck.bad_chains, ck.size_mismatches, ck.lost_clusters, ck.free_clusters);
+    if (status == FSCK_FOUND)
+        puts(ck.repair ? "Errors found and repaired" : "Errors found, run with -r to repair");
+
+    while ((fix = ck.fixes) != NULL) {
+        ck.fixes = fix->next;
+        free(fix);
+    }
+    free(ck.fat);
+    free(ck.owned);
+    free(ck.pointed);
+    pthread_cond_destroy(&ck.work);
+    pthread_mutex_destroy(&ck.lock);
+
+    // A check leaves the FSInfo hints as found, the unmount has nothing to write back
+    if (!ck.repair) {
+        ck.fs->info.free_cluster_count = BYTES_TO_LONG(ck.fs->info.buffer, FREE_CLUSTER_COUNT);
+        ck.fs->info.free_cluster = BYTES_TO_LONG(ck.fs->info.buffer, FREE_CLUSTER);
+    }
+    fat_fs_fini(ck.fs);
+    blkdev_close(dev);
+    close(fd);
+
+    return status;
+}
@@ -3,17 +3,39 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <pthread.h>
 
 #define CACHE_READ      0
 #define CACHE_WRITE     1
 
+#define AIO_READ        0
+#define AIO_WRITE       1
+#define AIO_NO_URING    0x01    // aio_init flag, always use the worker threads
+
 #define DRIVENAME                    "filesystem.img"
 
 #define LABEL_LENGTH                 11
 #define SECTOR_SIZE                  512
 #define UNDEFINED_SECCOUNT           65535
 
+// Concurrency model
+//
+// A mounted fat_fs_t can be shared by any number of threads. The path, file
+// and directory calls take fs->lock: shared for lookups, reads and in-place
+// overwrites; exclusive for anything that changes the FAT, a directory or
+// FSInfo (create, delete, growth, allocation, flush). Readers only touch the
+// lock slot of their thread, writers take every slot. Functions documented as
+// "fs->lock held" are the building blocks of those calls and do not lock.
+// The block cache locks per shard, the path cache has a lock of its own.
+// A file_t can be shared, its extent map and readahead state are guarded by
+// file->lock. A dir_t, like a DIR stream, belongs to one thread at a time.
+// Descriptors from fat_open can be shared, calls on one descriptor serialize.
+// Statistics counters are updated atomically.
+
 // Macros
+#define FS_STAT_ADD(FS, FIELD, N)    __atomic_fetch_add(&(FS)->stats.FIELD, (N), __ATOMIC_RELAXED)
 #define BYTES_TO_WORD(BYTES, OFF)    (BYTES[0 + OFF] + (BYTES[1 + OFF] << 8))
 #define BYTES_TO_LONG(BYTES, OFF)    (BYTES[0 + OFF] + (BYTES[1 + OFF] << 8) + (BYTES[2 + OFF] << 16) + (BYTES[3 + OFF] << 24))
 
@@ -27,7 +49,9 @@
 #define LARGE_SECTOR_COUNT      0x20
 #define FAT_TABLE_SIZE          0x24
 #define ROOT_CLUSTER            0x2C
+#define EXT_FLAGS               0x28
 #define FSINFO_SECTOR           0x30
+#define NO_FAT_MIRROR           0x80
 
 #define LEAD_SIGNATURE1_OFF     0x00
 #define LEAD_SIGNATURE1         0x41615252
@@ -44,15 +68,33 @@
 #define READ_ERROR              0xFFFFFFFF
 #define CLUSTER_ALLOC_ERR       1
 
+#define FS_MOUNT_TRUST_FSINFO   0x01    // Take valid FSInfo hints instead of scanning the FAT
+#define FS_MOUNT_LAZY_BITMAP    0x02    // Build the free cluster bitmap on first allocation
+#define FS_MOUNT_LAZY_ROOT      0x04    // Open the root directory on first lookup
+#define FS_MOUNT_FAST           (FS_MOUNT_TRUST_FSINFO | FS_MOUNT_LAZY_BITMAP | FS_MOUNT_LAZY_ROOT)
+
+#define FS_LOCK_SLOTS           16      // Reader slots of the filesystem lock
+#define FS_DIRS_SIZE            64      // Directories kept open with their index, see dir_get
+
+#define FAT_O_RDONLY            0x00
+#define FAT_O_WRONLY            0x01
+#define FAT_O_RDWR              0x02
+#define FAT_O_ACCMODE           0x03
+#define FAT_O_CREAT             0x04    // Create the file in its parent directory if missing
+#define FAT_O_APPEND            0x08    // Every write goes to the end of file
+
+#define FAT_ENTRY_MASK          0x0FFFFFFF
 #define EOC1                    0xFFFFFF8
 #define EOC2                    0xFFFFFFF
 #define FAT_EOF                 0x1a
+#define FILE_ALLOC_KEEP_SIZE    1       // file_allocate: clusters past the size stay in the chain, fatfsck accepts them
 #define SHORT_NAME_LEN          11
 #define FILENAME_LEN            8
 #define FILE_EXT_LEN            3
 #define WORDS_TO_LONG(HIGH, LOW)    (LOW + (HIGH << 16))
 
 #define LFN_ATTR                0x0F
+#define VOLUME_ATTR             0x08
 #define DIR_ATTR                0x10
 #define FILE_ATTR               0x20
 #define ATTR_OFFSET             11
@@ -65,19 +107,56 @@
 
 #define INVALID_ENTRY           (char) (0xE5)
 
+typedef struct blkdev_ops blkdev_ops_t;
+typedef struct blkdev blkdev_t;
 typedef struct fat_fsinfo fat_fsinfo_t;
 typedef struct fat_volume fat_volume_t;
 typedef struct fat_table fat_table_t;
+typedef struct fat_bitmap fat_bitmap_t;
 typedef struct fat_fs fat_fs_t;
+typedef struct cache_stats cache_stats_t;
+typedef struct fat_stats fat_stats_t;
+typedef struct fat_mount_times fat_mount_times_t;
 typedef struct cache cache_t;
 typedef struct cache_line cache_line_t;
+typedef struct cache_shard cache_shard_t;
 typedef struct entry entry_t;
+typedef struct extent extent_t;
+typedef struct extent_map extent_map_t;
 typedef struct file file_t;
+typedef struct file_pos file_pos_t;
+typedef struct fat_handle fat_handle_t;
 typedef struct dir dir_t;
+typedef struct dir_iter dir_iter_t;
+typedef struct dentry dentry_t;
+typedef struct dcache dcache_t;
+typedef struct aio aio_t;
+typedef struct fs_lock fs_lock_t;
+typedef struct aio_ring aio_ring_t;
+typedef struct aio_req aio_req_t;
+typedef struct aio_batch aio_batch_t;
+
+struct blkdev_ops
+{
+    uint8_t (*read) (blkdev_t *, uint64_t, uint8_t *, size_t);
+    uint8_t (*write) (blkdev_t *, uint64_t, uint8_t *, size_t);
+    uint8_t (*writev) (blkdev_t *, uint64_t, struct iovec *, int);
+    uint8_t *(*map) (blkdev_t *, uint64_t, size_t);
+    void (*close) (blkdev_t *);
+};
+
+struct blkdev
+{
+    const blkdev_ops_t *ops;
+    int fd;
+    uint8_t *base;
+    uint64_t size;
+};
 
 struct fat_volume
 {
-    FILE *drive;
+    blkdev_t *dev;
+    uint8_t owns_dev;
     char *label;
     uint32_t sector_count;
     uint32_t cluster_count;
@@ -96,36 +175,134 @@ struct fat_fsinfo
     uint32_t free_cluster;
 };
 
+// One bit per cluster, set when free; summary has one bit per non-empty word
+struct fat_bitmap
+{
+    uint64_t *words;
+    uint64_t *summary;
+    size_t word_count;
+    uint32_t cluster_max;
+    uint32_t free_count;
+};
+
 struct fat_table
 {
     uint32_t address;
     size_t size;
     uint32_t count;
-    cache_t *cache;
+    fat_bitmap_t *bitmap;
+    uint8_t lazy;               // Bitmap deferred to the first allocation
+    uint8_t mirror;             // Copies past the first follow it at flush time
+    uint64_t *mirror_dirty;     // FAT sectors written since the last mirror pass
+};
+
+struct cache_stats
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;
+    uint64_t prefetched;
+};
+
+// Counters since mount or the last fat_fs_stats_reset
+struct fat_stats
+{
+    cache_stats_t fat_cache;     // Blocks before the data region
+    cache_stats_t data_cache;    // File and directory clusters
+    uint64_t sectors_read;
+    uint64_t sectors_written;
+    uint64_t device_reads;
+    uint64_t device_writes;
+    uint64_t fat_reads;
+    uint64_t fat_writes;
+    uint64_t chain_steps;
+    uint64_t dir_entries_scanned;
+};
+
+// Time spent in each phase of the last mount, in nanoseconds
+struct fat_mount_times
+{
+    uint64_t superblock;        // BPB and FSInfo
+    uint64_t caches;            // Block cache, path cache and I/O queue
+    uint64_t free_space;        // Bitmap build or FAT scans
+    uint64_t root;              // Root directory
+    uint64_t total;
 };
 
+// One slot of the filesystem lock. Readers take the slot of their thread,
+// writers every slot, so shared holders do not bounce one cache line
+struct fs_lock
+{
+    pthread_rwlock_t lock;
+} __attribute__((aligned(64)));
+
 struct fat_fs
 {
     fat_volume_t *volume;
     fat_table_t *table;
     fat_fsinfo_t info;
+    cache_t *cache;
+    dcache_t *dcache;
     dir_t *root_dir;
+    fat_stats_t stats;
+    fat_mount_times_t mount_times;
+    fs_lock_t *lock;            // FS_LOCK_SLOTS slots, see fat_fs_lock_read
+    aio_t *aio;
+    size_t mem_limit;           // Budget of the caches in bytes, 0 for the default sizes
+    dir_t *dirs[FS_DIRS_SIZE];  // Shared directories other than the root, by first cluster
+    size_t dirs_hand;           // Next slot to recycle
+    pthread_mutex_t dirs_lock;
+    fat_handle_t **handles;     // Indexed by descriptor, NULL when free
+    int handle_count;
+    file_t **files;             // Files open through descriptors, one per directory entry
+    int file_count;
+    int file_capacity;
+    pthread_mutex_t handle_lock;
 };
 
 struct cache_line 
 {
     int valid;
-    int tag;
+    int dirty;
+    uint32_t tag;
     uint8_t *data;
+    int prev;
+    int next;
+    int hnext;
 };
 
+// Independently locked slice of the cache with its own lines and LRU list.
+// Aligned so that two shards never share a CPU cache line
+struct cache_shard
+{
+    size_t cache_size;
+    cache_line_t *lines;
+    uint8_t *slab;
+    int *buckets;
+    size_t bucket_count;
+    int lru_head;
+    int lru_tail;
+    pthread_mutex_t lock;
+    struct iovec *iov;      // Eviction write-back runs, one vector per line
+} __attribute__((aligned(64)));
+
+// Sector cache shared by the FAT table and every open file, LRU replacement.
+// Aligned runs of 8 sectors are spread round robin over the shards
 struct cache
 {
     size_t cache_size;
     size_t block_size;
-    uint8_t *(*read) (fat_fs_t *, uint32_t);
-    void (*write) (fat_fs_t *, uint32_t, uint8_t *);
-    cache_line_t *lines;
+    uint8_t *(*read) (fat_fs_t *, uint32_t, uint8_t *);
+    uint8_t (*writev) (fat_fs_t *, uint32_t, struct iovec *, int);
+    cache_shard_t *shards;
+    size_t shard_count;
+    pthread_mutex_t prefetch_lock;
+    uint8_t *prefetch;
+    size_t prefetch_max;    // Blocks the prefetch buffer holds
+    struct iovec *iov;      // Flush runs, built with every shard locked
+    uint32_t *flush_tags;
+    aio_req_t *flush_reqs;
 };
 
 struct short_name 
@@ -147,78 +324,363 @@ struct entry
     uint32_t size;
 }__attribute__((packed));
 
+// Run of contiguous clusters starting at file cluster index
+struct extent
+{
+    uint32_t index;
+    uint32_t cluster;
+    uint32_t length;
+};
+
+struct extent_map
+{
+    extent_t *extents;
+    size_t count;
+    size_t capacity;
+    uint32_t mapped;
+    uint8_t complete;
+};
+
 struct file
 {
     char *path;
     entry_t *entry;
-    cache_t *cache;
     uint32_t cluster;
+    extent_map_t map;
+    uint32_t ra_next;       // Offset a sequential read would start at
+    uint32_t ra_end;        // End of the data already read ahead
+    int opens;              // Descriptors sharing the file, see fat_open
+    pthread_mutex_t lock;
+};
+
+// Extent of the chain a cursor last moved through: clusters [index, index + length)
+// start at cluster. Offsets inside it resolve without touching the extent map
+struct file_pos
+{
+    uint32_t index;
+    uint32_t cluster;
+    uint32_t length;
+    size_t extent;          // Slot of the extent in the map
+};
+
+// Open descriptor: a file with its own offset and cursor. Calls on one
+// descriptor are serialized by handle->lock, which is taken before fs->lock
+struct fat_handle
+{
+    file_t *file;
+    uint32_t offset;
+    uint32_t flags;
+    file_pos_t pos;
+    int refs;               // The descriptor and every call using it, see fat_handle_get
+    pthread_mutex_t lock;
 };
 
 struct dir
 {
     file_t *ident;
     size_t num_entries;
-    entry_t **entries;
+    size_t used_entries;
+    size_t capacity;
+    entry_t *entries;       // Live entries of the last dir_scan, in one block
+    char *names;            // Their case folded short names, SHORT_NAME_LEN apart
+    uint32_t *offsets;      // Their byte offsets in the directory
+    int *buckets;           // Short name hash index, NULL for small directories
+    int *chain;
+    size_t bucket_count;
+    uint32_t *holes;        // Deleted slots seen by the scan, reused by dir_entry_create
+    size_t hole_count;
+    size_t hole_capacity;
+    uint32_t end;           // Offset of the end of directory marker at the scan
+    size_t probed;          // Slots walked by linear lookups, see dir_locate
+    int refs;               // Holders, dir_close frees the dir_t with the last one
+    uint8_t shared;         // The root or in fs->dirs, only these keep a scan for lookups
+    pthread_mutex_t lock;   // Guards the scan, lookups only hold fs->lock shared
 };
 
+// Cursor over the raw directory clusters, entries are decoded into entry
+struct dir_iter
+{
+    dir_t *dir;
+    uint32_t offset;
+    uint32_t lba;
+    entry_t entry;
+};
+
+#define DCACHE_PATH_LEN         128
+#define DCACHE_MISS             0
+#define DCACHE_HIT              1
+#define DCACHE_NEGATIVE         2
+
+// Cached result of an absolute path lookup, negative when the path does not exist
+struct dentry
+{
+    char path[DCACHE_PATH_LEN];
+    uint32_t hash;
+    uint32_t parent;
+    uint8_t used;
+    uint8_t negative;
+    uint8_t referenced;
+    int hnext;
+    int pnext;              // Next dentry in the same parent bucket
+    entry_t entry;
+};
+
+struct dcache
+{
+    dentry_t *slots;
+    size_t capacity;
+    int *buckets;
+    int *parents;           // Dentries chained by parent cluster, bucket_count of them
+    size_t bucket_count;
+    size_t hand;
+    pthread_mutex_t lock;
+};
+
+// Completion group, a future over every request submitted with it
+struct aio_batch
+{
+    unsigned pending;
+    uint8_t status;
+};
+
+struct aio_req
+{
+    uint8_t op;
+    uint64_t offset;
+    struct iovec *iov;
+    int iov_count;
+    struct iovec vec;       // Storage for single buffer requests
+    aio_batch_t *batch;
+    void (*done) (aio_req_t *, uint8_t);    // Optional, runs on the completing thread
+    void *arg;
+    aio_req_t *next;
+};
+
+struct aio_ring
+{
+    int fd;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    struct io_uring_cqe *cqes;
+    uint32_t *sq_head;
+    uint32_t *sq_tail;
+    uint32_t *sq_mask;
+    uint32_t *sq_array;
+    uint32_t *cq_head;
+    uint32_t *cq_tail;
+    uint32_t *cq_mask;
+};
+
+// Device I/O queue keeping up to depth requests in flight: io_uring when the
+// kernel has it, a pool of worker threads otherwise. Mapped devices run inline.
+// Nothing is started before the first submission
+struct aio
+{
+    blkdev_t *dev;
+    unsigned depth;
+    unsigned inflight;
+    uint8_t flags;
+    uint8_t started;            // Ring or workers set up, on the first submission
+    uint8_t stop;
+    pthread_mutex_t lock;
+    pthread_cond_t done;        // A request completed
+    pthread_cond_t work;        // Worker threads only
+    aio_req_t *head;
+    aio_req_t *tail;
+    pthread_t *threads;
+    size_t thread_count;
+    aio_ring_t *ring;
+};
+
+// src/aio.c
+aio_t *aio_init(blkdev_t *dev, unsigned depth, uint8_t flags);
+void aio_batch_init(aio_batch_t *batch);
+void aio_batch_fail(aio_t *aio, aio_batch_t *batch);
+uint8_t aio_submit(aio_t *aio, aio_req_t *req);
+uint8_t aio_wait(aio_t *aio, aio_batch_t *batch);
+void aio_fini(aio_t *aio);
+
 // src/cache.c
 
-cache_t *cache_init(size_t cache_size, size_t block_size, uint8_t *(*read_fun)(fat_fs_t *, uint32_t), void (*write_fun) (fat_fs_t *, uint32_t, uint8_t *));
+cache_t *cache_init(size_t cache_size, size_t block_size, uint8_t *(*read_fun)(fat_fs_t *, uint32_t, uint8_t *), uint8_t (*writev_fun) (fat_fs_t *, uint32_t, struct iovec *, int));
 cache_line_t *cache_lines_create(size_t line_count);
+size_t cache_line_cost(size_t block_size);
+size_t cache_lines_for(size_t budget, size_t block_size);
+size_t cache_mem_size(cache_t *cache);
+uint8_t cache_get(cache_t *cache, fat_fs_t *fs, uint32_t sector, uint32_t offset, uint8_t *buffer, size_t len);
+uint8_t cache_put(cache_t *cache, fat_fs_t *fs, uint32_t sector, uint32_t offset, uint8_t *buffer, size_t len);
 uint8_t cache_readb(cache_t *cache, fat_fs_t *fs, uint32_t sector, uint32_t offset);
+uint16_t cache_readw(cache_t *cache, fat_fs_t *fs, uint32_t sector, uint32_t offset);
 uint32_t cache_readl(cache_t *cache, fat_fs_t *fs, uint32_t sector, uint32_t offset);
 void cache_writeb(cache_t *cache, fat_fs_t *fs, uint32_t sector, uint32_t offset, uint8_t data);
+void cache_writew(cache_t *cache, fat_fs_t *fs, uint32_t sector, uint32_t offset, uint16_t data);
 void cache_writel(cache_t *cache, fat_fs_t *fs, uint32_t sector, uint32_t offset, uint32_t data);
-void cache_flush(cache_t *cache, fat_fs_t *fs);
-void cache_lines_destroy(cache_line_t *cache_lines, size_t line_count);
+cache_line_t *cache_get_line(cache_t *cache, cache_shard_t *shard, fat_fs_t *fs, uint32_t tag);
+uint8_t cache_contains(cache_t *cache, uint32_t tag);
+uint8_t cache_span(cache_t *cache, fat_fs_t *fs, uint32_t tag, uint32_t offset, uint8_t *buffer, size_t len, uint8_t mode);
+void cache_prefetch(cache_t *cache, fat_fs_t *fs, uint32_t tag, uint32_t count);
+uint8_t cache_flush(cache_t *cache, fat_fs_t *fs);
+uint8_t cache_sync_range(cache_t *cache, fat_fs_t *fs, uint32_t tag, uint32_t count);
+void cache_invalidate_range(cache_t *cache, uint32_t tag, uint32_t count);
+void cache_lines_destroy(cache_line_t *cache_lines);
 void cache_fini(cache_t *cache);
 
+// src/blkdev.c
+blkdev_t *blkdev_fd_open(int fd);
+blkdev_t *blkdev_mmap_open(int fd);
+blkdev_t *blkdev_mem_open(uint8_t *buffer, uint64_t size);
+void blkdev_close(blkdev_t *dev);
+
 // src/fs.c
-fat_volume_t *fat_volume_init(FILE *drive);
+fat_volume_t *fat_volume_init(blkdev_t *dev);
 uint8_t *read_sector(fat_fs_t *fs, uint32_t lba);
 uint8_t *read_sectors(fat_fs_t *fs, uint32_t lba, uint32_t n);
-void write_sector(fat_fs_t *fs, uint32_t lba, uint8_t *buffer);
+uint8_t read_sectors_into(fat_fs_t *fs, uint32_t lba, uint32_t n, uint8_t *buffer);
+uint8_t *read_sector_cached(fat_fs_t *fs, uint32_t lba, uint8_t *buffer);
+uint8_t write_sector(fat_fs_t *fs, uint32_t lba, uint8_t *buffer);
+void write_sectors(fat_fs_t *fs, uint32_t lba, uint8_t *buffer, uint32_t n);
+uint8_t write_sectors_vec(fat_fs_t *fs, uint32_t lba, struct iovec *iov, int n);
+uint8_t read_sectors_submit(fat_fs_t *fs, uint32_t lba, uint32_t n, uint8_t *buffer, aio_req_t *req, aio_batch_t *batch);
+uint8_t write_sectors_submit(fat_fs_t *fs, uint32_t lba, uint8_t *buffer, uint32_t n, aio_req_t *req, aio_batch_t *batch);
+uint8_t write_sectors_vec_submit(fat_fs_t *fs, uint32_t lba, struct iovec *iov, int n, aio_req_t *req, aio_batch_t *batch);
+uint8_t fat_fs_io_wait(fat_fs_t *fs, aio_batch_t *batch);
+uint8_t *map_sectors(fat_fs_t *fs, uint32_t lba, uint32_t n);
 void fat_volume_fini(fat_volume_t *volume);
 uint8_t *read_cluster(fat_fs_t *fs, uint32_t cluster);
+uint8_t read_cluster_into(fat_fs_t *fs, uint32_t cluster, uint8_t *buffer);
 void write_cluster(fat_fs_t *fs, uint32_t cluster, uint8_t *buffer);
+uint32_t cluster_to_lba(fat_fs_t *fs, uint32_t cluster);
 
+entry_t *fake_entry_create(uint32_t cluster, char *name, size_t size);
 fat_fs_t *fat_fs_init(FILE *partition);
+fat_fs_t *fat_fs_mount(blkdev_t *dev);
+fat_fs_t *fat_fs_mount_flags(blkdev_t *dev, uint32_t flags);
+fat_fs_t *fat_fs_mount_mem(blkdev_t *dev, uint32_t flags, size_t mem_limit);
+void fat_fs_lock_read(fat_fs_t *fs);
+void fat_fs_lock_write(fat_fs_t *fs);
+void fat_fs_unlock(fat_fs_t *fs);
+dir_t *fat_fs_root(fat_fs_t *fs);
 uint8_t fat_fs_getinfo(fat_fs_t *fs);
+size_t fat_fs_mem_usage(fat_fs_t *fs);
+void fat_fs_stats(fat_fs_t *fs, fat_stats_t *stats);
+void fat_fs_stats_reset(fat_fs_t *fs);
+uint8_t fat_fs_flush(fat_fs_t *fs);
 void fat_fs_fini(fat_fs_t *fs);
 
 // src/table.c
-fat_table_t *fat_table_init(fat_volume_t *volume);
-void fat_table_fini(fat_table_t *table, fat_fs_t *fs);
+fat_table_t *fat_table_init(void);
+void fat_table_fini(fat_table_t *table);
+uint8_t fat_table_mirror_init(fat_table_t *table);
+void fat_table_mirror(fat_fs_t *fs);
 uint32_t fat_table_read(fat_fs_t *fs, uint32_t cluster);
 void fat_table_write(fat_fs_t *fs, uint32_t cluster, uint32_t content);
+void fat_table_bitmap_load(fat_fs_t *fs);
 uint32_t free_cluster_count_read(fat_fs_t *fs);
 uint32_t first_free_cluster_read(fat_fs_t *fs);
 uint32_t fat_table_alloc_cluster(fat_fs_t *fs, uint32_t content);
+uint32_t fat_table_alloc_run(fat_fs_t *fs, uint32_t prev, uint32_t count, uint32_t *len);
+void cluster_chain_free(fat_fs_t *fs, uint32_t start);
 uint32_t cluster_chain_get_len(fat_fs_t *fs, uint32_t start);
 uint32_t cluster_chain_read(fat_fs_t *fs, uint32_t curr, uint32_t index);
 
+// src/scan.c
+uint32_t fat_scan_count(const uint8_t *entries, uint32_t from, uint32_t to);
+uint32_t fat_scan_find(const uint8_t *entries, uint32_t from, uint32_t to);
+uint32_t fat_scan_run(const uint8_t *entries, uint32_t from, uint32_t to);
+void fat_scan_masks(const uint8_t *entries, uint32_t to, uint64_t *masks);
+
+// src/bitmap.c
+fat_bitmap_t *fat_bitmap_init(fat_fs_t *fs);
+uint8_t fat_bitmap_build(fat_fs_t *fs, fat_bitmap_t *bitmap);
+void fat_bitmap_set(fat_bitmap_t *bitmap, uint32_t cluster, uint8_t is_free);
+uint8_t fat_bitmap_test(fat_bitmap_t *bitmap, uint32_t cluster);
+uint32_t fat_bitmap_find(fat_bitmap_t *bitmap, uint32_t start);
+uint32_t fat_bitmap_run(fat_bitmap_t *bitmap, uint32_t cluster, uint32_t max);
+uint32_t fat_bitmap_find_run(fat_bitmap_t *bitmap, uint32_t start, uint32_t count, uint32_t *len);
+void fat_bitmap_fini(fat_bitmap_t *bitmap);
+
 // src/file.c
 void rstrip_path(char *path);
 file_t *file_open(fat_fs_t *fs, entry_t *entry);
+uint32_t file_get_cluster(file_t *file, fat_fs_t *fs, uint32_t offset);
+uint32_t file_get_run(file_t *file, fat_fs_t *fs, uint32_t index, uint32_t *run);
+uint32_t file_pos_run(file_t *file, fat_fs_t *fs, file_pos_t *pos, uint32_t index, uint32_t *run);
 void file_close(fat_fs_t *fs, file_t *file);
 uint8_t file_readb(file_t *file, fat_fs_t *fs, uint32_t offset);
 uint8_t *file_read(file_t *file, fat_fs_t *fs, uint32_t offset, size_t size);
+size_t file_read_into(file_t *file, fat_fs_t *fs, uint32_t offset, uint8_t *buffer, size_t size);
+size_t file_read_at(file_t *file, fat_fs_t *fs, file_pos_t *pos, uint32_t offset, uint8_t *buffer, size_t size);
+size_t file_transfer(file_t *file, fat_fs_t *fs, file_pos_t *pos, uint32_t offset, uint8_t *buffer, size_t size,
+                     uint8_t mode);
+size_t file_write_from(file_t *file, fat_fs_t *fs, uint32_t offset, uint8_t *buffer, size_t size);
+size_t file_write_at(file_t *file, fat_fs_t *fs, file_pos_t *pos, uint32_t offset, uint8_t *buffer, size_t size);
+size_t file_grow_from(file_t *file, fat_fs_t *fs, file_pos_t *pos, uint32_t offset, uint8_t *buffer, size_t size);
 void file_writeb(file_t *file, fat_fs_t *fs, uint32_t offset, uint8_t data);
 void file_write(file_t *file, fat_fs_t *fs, uint32_t offset, uint8_t *data, size_t size);
-void file_create(fat_fs_t *fs, char *path, char *filename);
+uint8_t file_reserve(file_t *file, fat_fs_t *fs, uint32_t size, uint32_t *chain);
+uint8_t file_allocate(file_t *file, fat_fs_t *fs, uint32_t size, uint8_t mode);
+size_t file_append(file_t *file, fat_fs_t *fs, uint8_t *buffer, size_t size);
+uint8_t file_entry_sync(file_t *file, fat_fs_t *fs);
+void file_zero_fill(file_t *file, fat_fs_t *fs, uint32_t from, uint32_t to);
+uint8_t file_create(fat_fs_t *fs, char *path, char *filename);
+uint8_t file_create_unlocked(fat_fs_t *fs, char *path, char *filename);
 void file_delete(fat_fs_t *fs, char *path);
+void file_delete_unlocked(fat_fs_t *fs, char *path);
 file_t *file_open_path(fat_fs_t *fs, char *path);
+file_t *file_open_path_unlocked(fat_fs_t *fs, char *path);
 entry_t *file_entry_create(char *filename, uint32_t cluster);
 
+// src/handle.c
+int fat_open(fat_fs_t *fs, char *path, uint32_t flags);
+ssize_t fat_read(fat_fs_t *fs, int fd, void *buffer, size_t size);
+ssize_t fat_write(fat_fs_t *fs, int fd, void *buffer, size_t size);
+int64_t fat_lseek(fat_fs_t *fs, int fd, int64_t offset, int whence);
+int fat_close(fat_fs_t *fs, int fd);
+void fat_handle_fini(fat_fs_t *fs);
+
+// src/extent.c
+void extent_map_init(extent_map_t *map, uint32_t first_cluster);
+uint8_t extent_map_append(extent_map_t *map, uint32_t cluster);
+uint8_t extent_map_append_run(extent_map_t *map, uint32_t cluster, uint32_t length);
+void extent_map_extend(fat_fs_t *fs, extent_map_t *map, uint32_t index);
+uint32_t extent_map_lookup(fat_fs_t *fs, extent_map_t *map, uint32_t index);
+uint32_t extent_map_lookup_run(fat_fs_t *fs, extent_map_t *map, uint32_t index, uint32_t *run);
+void extent_map_lookup_pos(fat_fs_t *fs, extent_map_t *map, uint32_t index, uint32_t run, file_pos_t *pos);
+void extent_map_fini(extent_map_t *map);
+
+// src/dcache.c
+dcache_t *dcache_init(size_t capacity);
+size_t dcache_entries_for(size_t budget);
+size_t dcache_mem_size(dcache_t *dcache);
+uint8_t dcache_lookup(dcache_t *dcache, char *path, entry_t *entry);
+void dcache_insert(dcache_t *dcache, char *path, uint32_t parent, entry_t *entry);
+void dcache_update(dcache_t *dcache, uint32_t parent, entry_t *old, entry_t *entry);
+void dcache_clear(dcache_t *dcache);
+void dcache_fini(dcache_t *dcache);
+
 // src/dir.c
 dir_t *dir_init(fat_fs_t *fs, entry_t *entry);
+dir_t *dir_get(fat_fs_t *fs, entry_t *entry);
+dir_t *dir_hold(dir_t *dir);
+void dir_shared_fini(fat_fs_t *fs);
+size_t dir_mem_size(fat_fs_t *fs);
 void dir_scan(fat_fs_t *fs, dir_t *dir);
-entry_t *dir_search(dir_t *dir, char *name);
-entry_t *dir_search_path(fat_fs_t *fs, dir_t *dir, char *path);
-void dir_entry_create(fat_fs_t *fs, dir_t *dir, entry_t *entry);
+entry_t *dir_find(fat_fs_t *fs, dir_t *dir, char *name);
+entry_t *dir_find_unlocked(fat_fs_t *fs, dir_t *dir, char *name);
+entry_t *dir_locate(fat_fs_t *fs, dir_t *dir, char *key, dir_iter_t *it);
+void dir_iter_init(dir_iter_t *it, dir_t *dir);
+entry_t *dir_iter_next(fat_fs_t *fs, dir_iter_t *it);
+entry_t *dir_iter_next_unlocked(fat_fs_t *fs, dir_iter_t *it);
+uint8_t short_name_key(char *name, char *key);
+entry_t *dir_lookup_path(fat_fs_t *fs, char *path);
+uint8_t dir_entry_create(fat_fs_t *fs, dir_t *dir, entry_t *entry);
 void dir_entry_override(fat_fs_t *fs, dir_t *dir, char *short_name, entry_t *entry);
 dir_t *dir_open_path(fat_fs_t *fs, char *path);
+dir_t *dir_open_path_unlocked(fat_fs_t *fs, char *path);
 void dir_close(fat_fs_t *fs, dir_t *dir);
 
 #endif
\ No newline at end of file
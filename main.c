@@ -13,14 +13,35 @@ void fat_fs_printinfo(fat_fs_t *fs)
     printf("Fat table address:\t%u\n", fs->table->address);
     printf("Fat table size:\t\t%lu Sec\n", fs->table->size);
     printf("Fat table count:\t%u FATs\n", fs->table->count);
-    if (fs->table->cache != NULL)
-        puts("Fat table cache ENGAGED!");
+    if (fs->cache != NULL)
+        printf("Block cache:\t\t%lu x %luB\n", fs->cache->cache_size, fs->cache->block_size);
+    printf("Cache memory:\t\t%luB\n", fat_fs_mem_usage(fs));
     printf("\nRoot cluster:\t\t%u\n", fs->info.root_cluster);
     printf("Free cluster count:\t%u\n", fs->info.free_cluster_count);
     printf("First free cluster:\t%u\n", fs->info.free_cluster);
     puts("-------------------------------");
 }
 
+void fat_fs_printstats(fat_fs_t *fs)
+{
+    fat_stats_t stats;
+
+    fat_fs_stats(fs, &stats);
+    puts("-------------------------------");
+    printf("FAT cache:\t\t%lu hit, %lu miss, %lu evict, %lu wb, %lu ahead\n",
+           stats.fat_cache.hits, stats.fat_cache.misses,
+           stats.fat_cache.evictions, stats.fat_cache.writebacks, stats.fat_cache.prefetched);
+    printf("Data cache:\t\t%lu hit, %lu miss, %lu evict, %lu wb, %lu ahead\n",
+           stats.data_cache.hits, stats.data_cache.misses,
+           stats.data_cache.evictions, stats.data_cache.writebacks, stats.data_cache.prefetched);
+    printf("Device reads:\t\t%lu calls, %lu Sec\n", stats.device_reads, stats.sectors_read);
+    printf("Device writes:\t\t%lu calls, %lu Sec\n", stats.device_writes, stats.sectors_written);
+    printf("FAT entries:\t\t%lu read, %lu written\n", stats.fat_reads, stats.fat_writes);
+    printf("Chain steps:\t\t%lu\n", stats.chain_steps);
+    printf("Dir entries scanned:\t%lu\n", stats.dir_entries_scanned);
+    puts("-------------------------------");
+}
+
 int main() 
 {
     file_t *test_file;
@@ -45,6 +66,8 @@ int main()
     if (test_file)
         file_close(fs, test_file);
 
+    fat_fs_printstats(fs);
+
     fat_fs_fini(fs);
 
 exit:
@@ -0,0 +1,388 @@
+#include <include/fat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define AIO_HAVE_URING
+#endif
+// The reaper needs a bounded wait to notice aio->stop, see aio_ring_reaper
+#if defined(AIO_HAVE_URING) && !defined(IORING_ENTER_EXT_ARG)
+#undef AIO_HAVE_URING
+#endif
+
+#define AIO_POOL_MAX        8
+#define AIO_REAPER_TICK_NS  (200 * 1000 * 1000)
+
+// Synchronous path, used inline, by the workers and to finish short transfers
+uint8_t aio_execute(aio_t *aio, aio_req_t *req)
+{
+    uint64_t offset = req->offset;
+
+    if (req->op == AIO_WRITE)
+        return aio->dev->ops->writev(aio->dev, offset, req->iov, req->iov_count);
+
+    for (int i=0; i < req->iov_count; i++) {
+        if (aio->dev->ops->read(aio->dev, offset, req->iov[i].iov_base, req->iov[i].iov_len) != 0)
+            return FS_ERROR;
+        offset += req->iov[i].iov_len;
+    }
+
+    return 0;
+}
+
+void aio_complete(aio_t *aio, aio_req_t *req, uint8_t status)
+{
+    aio_batch_t *batch = req->batch;
+
+    // The callback runs first, a waiter may release req once the batch drains
+    if (req->done != NULL)
+        req->done(req, status);
+
+    pthread_mutex_lock(&aio->lock);
+    aio->inflight--;
+    if (batch != NULL) {
+        if (status != 0)
+            batch->status = FS_ERROR;
+        batch->pending--;
+    }
+    pthread_cond_broadcast(&aio->done);
+    pthread_mutex_unlock(&aio->lock);
+}
+
+void *aio_worker(void *arg)
+{
+    aio_t *aio = arg;
+    aio_req_t *req;
+
+    pthread_mutex_lock(&aio->lock);
+    for (;;) {
+        while (aio->head == NULL && !aio->stop)
+            pthread_cond_wait(&aio->work, &aio->lock);
+        if (aio->head == NULL)
+            break;
+
+        req = aio->head;
+        aio->head = req->next;
+        if (aio->head == NULL)
+            aio->tail = NULL;
+
+        pthread_mutex_unlock(&aio->lock);
+        aio_complete(aio, req, aio_execute(aio, req));
+        pthread_mutex_lock(&aio->lock);
+    }
+    pthread_mutex_unlock(&aio->lock);
+
+    return NULL;
+}
+
+#ifdef AIO_HAVE_URING
+
+uint8_t aio_ring_init(aio_t *aio)
+{
+    struct io_uring_params params;
+    aio_ring_t *ring;
+
+    ring = malloc(sizeof(*ring));
+    if (ring == NULL) {
+        puts("Malloc error: not enough space to allocate I/O ring");
+        return FS_ERROR;
+    }
+
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, aio->depth, &params);
+    if (ring->fd < 0) {
+        free(ring);
+        return FS_ERROR;
+    }
+    // Kernels without timed waits get the worker pool
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        close(ring->fd);
+        free(ring);
+        return FS_ERROR;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->sq_ring != MAP_FAILED)
+            munmap(ring->sq_ring, ring->sq_ring_size);
+        if (ring->cq_ring != MAP_FAILED)
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        if (ring->sqes != MAP_FAILED)
+            munmap(ring->sqes, ring->sqes_size);
+        close(ring->fd);
+        free(ring);
+        return FS_ERROR;
+    }
+
+    ring->sq_head = (uint32_t *) ((uint8_t *) ring->sq_ring + params.sq_off.head);
+    ring->sq_tail = (uint32_t *) ((uint8_t *) ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (uint32_t *) ((uint8_t *) ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (uint32_t *) ((uint8_t *) ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (uint32_t *) ((uint8_t *) ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (uint32_t *) ((uint8_t *) ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (uint32_t *) ((uint8_t *) ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) ((uint8_t *) ring->cq_ring + params.cq_off.cqes);
+
+    aio->ring = ring;
+    return 0;
+}
+
+// aio->lock held. Without SQPOLL the kernel consumes the entry before returning,
+// the submission ring never holds more than one
+uint8_t aio_ring_push(aio_t *aio, uint8_t opcode, aio_req_t *req)
+{
+    aio_ring_t *ring = aio->ring;
+    struct io_uring_sqe *sqe;
+    uint32_t tail;
+    uint32_t index;
+
+    tail = *ring->sq_tail;
+    index = tail & *ring->sq_mask;
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    if (req != NULL) {
+        sqe->fd = aio->dev->fd;
+        sqe->off = req->offset;
+        sqe->addr = (uintptr_t) req->iov;
+        sqe->len = req->iov_count;
+    }
+    sqe->user_data = (uintptr_t) req;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    if (syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0) == 1)
+        return 0;
+
+    // An entry the kernel did not take is withdrawn, the caller then runs the request
+    // itself. One it took completes through the ring whatever the call returned
+    if (__atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == tail) {
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+        return FS_ERROR;
+    }
+
+    return 0;
+}
+
+size_t aio_req_size(aio_req_t *req)
+{
+    size_t size = 0;
+
+    for (int i=0; i < req->iov_count; i++)
+        size += req->iov[i].iov_len;
+
+    return size;
+}
+
+// Only thread reading the completion ring. A NOP without request stops it; should
+// aio_fini fail to queue one, the timed wait still finds aio->stop within a tick
+void *aio_ring_reaper(void *arg)
+{
+    aio_t *aio = arg;
+    aio_ring_t *ring = aio->ring;
+    struct io_uring_getevents_arg wait;
+    struct __kernel_timespec tick;
+    struct io_uring_cqe *cqe;
+    aio_req_t *req;
+    uint32_t head;
+    int32_t res;
+
+    tick.tv_sec = 0;
+    tick.tv_nsec = AIO_REAPER_TICK_NS;
+    memset(&wait, 0, sizeof(wait));
+    wait.ts = (uintptr_t) &tick;
+
+    for (;;) {
+        head = *ring->cq_head;
+        if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            // Stop is only set once nothing is in flight
+            if (__atomic_load_n(&aio->stop, __ATOMIC_ACQUIRE))
+                return NULL;
+            syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                    &wait, sizeof(wait));
+            continue;
+        }
+
+        cqe = &ring->cqes[head & *ring->cq_mask];
+        req = (aio_req_t *) (uintptr_t) cqe->user_data;
+        res = cqe->res;
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+        if (req == NULL)
+            return NULL;
+
+        // Short or refused transfers are redone synchronously
+        if (res < 0 || (size_t) res != aio_req_size(req))
+            aio_complete(aio, req, aio_execute(aio, req));
+        else
+            aio_complete(aio, req, 0);
+    }
+}
+
+void aio_ring_fini(aio_t *aio)
+{
+    aio_ring_t *ring = aio->ring;
+
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sqes, ring->sqes_size);
+    close(ring->fd);
+    free(ring);
+    aio->ring = NULL;
+}
+
+#endif
+
+// Only bookkeeping, the ring or the workers start with the first submission
+aio_t *aio_init(blkdev_t *dev, unsigned depth, uint8_t flags)
+{
+    aio_t *aio;
+
+    aio = calloc(1, sizeof(*aio));
+    if (aio == NULL) {
+        puts("Malloc error: not enough space to allocate I/O queue");
+        return NULL;
+    }
+    aio->dev = dev;
+    aio->depth = depth > 0 ? depth : 1;
+    aio->flags = flags;
+    pthread_mutex_init(&aio->lock, NULL);
+    pthread_cond_init(&aio->done, NULL);
+    pthread_cond_init(&aio->work, NULL);
+
+    return aio;
+}
+
+// aio->lock held. Without threads every request runs inline
+void aio_start(aio_t *aio)
+{
+    aio->started = 1;
+
+    // Memory backends gain nothing from queueing, their requests run inline
+    if (aio->dev->ops->map != NULL)
+        return;
+
+#ifdef AIO_HAVE_URING
+    if (!(aio->flags & AIO_NO_URING) && aio_ring_init(aio) == 0) {
+        aio->threads = malloc(sizeof(*aio->threads));
+        if (aio->threads != NULL && pthread_create(&aio->threads[0], NULL, aio_ring_reaper, aio) == 0) {
+            aio->thread_count = 1;
+            return;
+        }
+        free(aio->threads);
+        aio_ring_fini(aio);
+    }
+#endif
+
+    aio->threads = malloc(sizeof(*aio->threads) * (aio->depth < AIO_POOL_MAX ? aio->depth : AIO_POOL_MAX));
+    if (aio->threads == NULL) {
+        puts("Malloc error: not enough space to allocate I/O workers");
+        return;
+    }
+    for (; aio->thread_count < aio->depth && aio->thread_count < AIO_POOL_MAX; aio->thread_count++)
+        if (pthread_create(&aio->threads[aio->thread_count], NULL, aio_worker, aio) != 0)
+            break;
+}
+
+void aio_batch_init(aio_batch_t *batch)
+{
+    batch->pending = 0;
+    batch->status = 0;
+}
+
+// Mark batch failed by a request that ran on the caller, completions may be updating it
+void aio_batch_fail(aio_t *aio, aio_batch_t *batch)
+{
+    pthread_mutex_lock(&aio->lock);
+    batch->status = FS_ERROR;
+    pthread_mutex_unlock(&aio->lock);
+}
+
+// Queue req, blocking while depth requests are already in flight.
+// req and its buffers belong to the queue until its batch is waited on
+uint8_t aio_submit(aio_t *aio, aio_req_t *req)
+{
+    uint8_t inline_io;
+
+    pthread_mutex_lock(&aio->lock);
+    if (!aio->started)
+        aio_start(aio);
+    while (aio->inflight >= aio->depth)
+        pthread_cond_wait(&aio->done, &aio->lock);
+    aio->inflight++;
+    if (req->batch != NULL)
+        req->batch->pending++;
+
+    inline_io = aio->thread_count == 0;
+#ifdef AIO_HAVE_URING
+    if (aio->ring != NULL && !inline_io &&
+        aio_ring_push(aio, req->op == AIO_WRITE ? IORING_OP_WRITEV : IORING_OP_READV, req) != 0)
+        inline_io = 1;
+#endif
+    if (!inline_io && aio->ring == NULL) {
+        req->next = NULL;
+        if (aio->tail != NULL)
+            aio->tail->next = req;
+        else
+            aio->head = req;
+        aio->tail = req;
+        pthread_cond_signal(&aio->work);
+    }
+    pthread_mutex_unlock(&aio->lock);
+
+    if (inline_io)
+        aio_complete(aio, req, aio_execute(aio, req));
+
+    return 0;
+}
+
+// Block until every request of batch completed, FS_ERROR if any of them failed
+uint8_t aio_wait(aio_t *aio, aio_batch_t *batch)
+{
+    uint8_t status;
+
+    pthread_mutex_lock(&aio->lock);
+    while (batch->pending > 0)
+        pthread_cond_wait(&aio->done, &aio->lock);
+    status = batch->status;
+    batch->status = 0;
+    pthread_mutex_unlock(&aio->lock);
+
+    return status;
+}
+
+void aio_fini(aio_t *aio)
+{
+    pthread_mutex_lock(&aio->lock);
+    while (aio->inflight > 0)
+        pthread_cond_wait(&aio->done, &aio->lock);
+    __atomic_store_n(&aio->stop, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&aio->work);
+#ifdef AIO_HAVE_URING
+    // Wakes the reaper at once, failing that it sees the stop flag on its next tick
+    if (aio->ring != NULL && aio->thread_count > 0)
+        aio_ring_push(aio, IORING_OP_NOP, NULL);
+#endif
+    pthread_mutex_unlock(&aio->lock);
+
+    for (size_t i=0; i < aio->thread_count; i++)
+        pthread_join(aio->threads[i], NULL);
+#ifdef AIO_HAVE_URING
+    if (aio->ring != NULL)
+        aio_ring_fini(aio);
+#endif
+
+    free(aio->threads);
+    pthread_cond_destroy(&aio->work);
+    pthread_cond_destroy(&aio->done);
+    pthread_mutex_destroy(&aio->lock);
+    free(aio);
+}
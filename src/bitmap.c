@@ -0,0 +1,212 @@
+#include <include/fat.h>
+#include <stdlib.h>
+
+#define BITMAP_SCAN_SECTORS     64
+#define WORD_BITS               64
+
+fat_bitmap_t *fat_bitmap_init(fat_fs_t *fs)
+{
+    fat_bitmap_t *bitmap;
+
+    bitmap = malloc(sizeof(*bitmap));
+    if (bitmap == NULL) {
+        puts("Malloc error: not enough space to allocate free cluster bitmap");
+        return NULL;
+    }
+
+    // Clusters are numbered from 2, keep 0 and 1 as permanently used bits
+    bitmap->cluster_max = fs->volume->cluster_count + 2;
+    bitmap->word_count = (bitmap->cluster_max + WORD_BITS - 1) / WORD_BITS;
+    bitmap->words = calloc(bitmap->word_count, sizeof(*bitmap->words));
+    bitmap->summary = calloc((bitmap->word_count + WORD_BITS - 1) / WORD_BITS, sizeof(*bitmap->summary));
+    if (bitmap->words == NULL || bitmap->summary == NULL) {
+        puts("Malloc error: not enough space to allocate free cluster bitmap");
+        fat_bitmap_fini(bitmap);
+        return NULL;
+    }
+    bitmap->free_count = 0;
+
+    if (fat_bitmap_build(fs, bitmap) != 0) {
+        fat_bitmap_fini(bitmap);
+        return NULL;
+    }
+
+    return bitmap;
+}
+
+uint8_t fat_bitmap_build(fat_fs_t *fs, fat_bitmap_t *bitmap)
+{
+    uint8_t *buffer;
+    uint32_t per_sector;
+    uint32_t cluster = 0;
+    uint32_t end;
+    uint32_t n;
+
+    per_sector = fs->volume->sector_size / sizeof(uint32_t);
+    buffer = malloc(BITMAP_SCAN_SECTORS * fs->volume->sector_size);
+    if (buffer == NULL) {
+        puts("Malloc error: not enough space to allocate FAT scan buffer");
+        return FS_ERROR;
+    }
+
+    // Scan the FAT in large batches straight from the disk, bypassing the cache.
+    // A deferred build can find FAT sectors still dirty in the cache
+    for (uint32_t sector=0; sector < fs->table->size && cluster < bitmap->cluster_max; sector += n) {
+        n = fs->table->size - sector;
+        if (n > BITMAP_SCAN_SECTORS)
+            n = BITMAP_SCAN_SECTORS;
+
+        if ((fs->cache != NULL && cache_sync_range(fs->cache, fs, fs->table->address + sector, n) != 0) ||
+            read_sectors_into(fs, fs->table->address + sector, n, buffer) != 0) {
+            free(buffer);
+            return FS_ERROR;
+        }
+
+        // Batches start on a word boundary, the scanner fills bitmap words directly
+        end = n * per_sector;
+        if (end > bitmap->cluster_max - cluster)
+            end = bitmap->cluster_max - cluster;
+        fat_scan_masks(buffer, end, &bitmap->words[cluster / WORD_BITS]);
+        cluster += end;
+    }
+    free(buffer);
+
+    // Clusters 0 and 1 hold the media byte and flags, never free space
+    bitmap->words[0] &= ~(uint64_t) 3;
+    for (size_t word=0; word < bitmap->word_count; word++) {
+        bitmap->free_count += __builtin_popcountll(bitmap->words[word]);
+        if (bitmap->words[word] != 0)
+            bitmap->summary[word / WORD_BITS] |= (uint64_t) 1 << (word % WORD_BITS);
+    }
+
+    return 0;
+}
+
+void fat_bitmap_set(fat_bitmap_t *bitmap, uint32_t cluster, uint8_t is_free)
+{
+    uint64_t mask;
+    size_t word;
+
+    if (cluster < 2 || cluster >= bitmap->cluster_max)
+        return;
+
+    word = cluster / WORD_BITS;
+    mask = (uint64_t) 1 << (cluster % WORD_BITS);
+
+    if (is_free && !(bitmap->words[word] & mask)) {
+        bitmap->words[word] |= mask;
+        bitmap->free_count++;
+    } else if (!is_free && (bitmap->words[word] & mask)) {
+        bitmap->words[word] &= ~mask;
+        bitmap->free_count--;
+    }
+
+    if (bitmap->words[word] != 0)
+        bitmap->summary[word / WORD_BITS] |= (uint64_t) 1 << (word % WORD_BITS);
+    else
+        bitmap->summary[word / WORD_BITS] &= ~((uint64_t) 1 << (word % WORD_BITS));
+}
+
+uint8_t fat_bitmap_test(fat_bitmap_t *bitmap, uint32_t cluster)
+{
+    if (cluster < 2 || cluster >= bitmap->cluster_max)
+        return 0;
+
+    return (bitmap->words[cluster / WORD_BITS] >> (cluster % WORD_BITS)) & 1;
+}
+
+uint32_t fat_bitmap_find_from(fat_bitmap_t *bitmap, uint32_t start)
+{
+    uint64_t bits;
+    size_t word;
+    size_t group;
+
+    if (start >= bitmap->cluster_max)
+        return 0;
+
+    // Finish the word holding start, then jump between non-empty words via the summary
+    word = start / WORD_BITS;
+    bits = bitmap->words[word] & (~(uint64_t) 0 << (start % WORD_BITS));
+    if (bits != 0)
+        return word * WORD_BITS + __builtin_ctzll(bits);
+
+    group = ++word / WORD_BITS;
+    if (word >= bitmap->word_count)
+        return 0;
+    bits = bitmap->summary[group] & (~(uint64_t) 0 << (word % WORD_BITS));
+
+    while (bits == 0) {
+        if (++group * WORD_BITS >= bitmap->word_count)
+            return 0;
+        bits = bitmap->summary[group];
+    }
+
+    word = group * WORD_BITS + __builtin_ctzll(bits);
+    return word * WORD_BITS + __builtin_ctzll(bitmap->words[word]);
+}
+
+uint32_t fat_bitmap_find(fat_bitmap_t *bitmap, uint32_t start)
+{
+    uint32_t cluster;
+
+    cluster = fat_bitmap_find_from(bitmap, start);
+    if (cluster == 0 && start > 2)
+        cluster = fat_bitmap_find_from(bitmap, 2);
+
+    return cluster;
+}
+
+// Length of the free run starting at cluster, capped at max
+uint32_t fat_bitmap_run(fat_bitmap_t *bitmap, uint32_t cluster, uint32_t max)
+{
+    uint32_t len = 0;
+
+    while (len < max && cluster + len < bitmap->cluster_max) {
+        // Whole free words are skipped at once
+        if ((cluster + len) % WORD_BITS == 0 && max - len >= WORD_BITS &&
+            bitmap->words[(cluster + len) / WORD_BITS] == ~(uint64_t) 0) {
+            len += WORD_BITS;
+            continue;
+        }
+        if (!fat_bitmap_test(bitmap, cluster + len))
+            break;
+        len++;
+    }
+
+    return len;
+}
+
+// First free run of count clusters from start, else the longest run seen
+uint32_t fat_bitmap_find_run(fat_bitmap_t *bitmap, uint32_t start, uint32_t count, uint32_t *len)
+{
+    uint32_t best = 0;
+    uint32_t cluster;
+    uint32_t end;
+    uint32_t run;
+
+    *len = 0;
+    for (int pass=0; pass < 2; pass++) {
+        cluster = fat_bitmap_find_from(bitmap, pass ? 2 : start);
+        end = pass ? start : bitmap->cluster_max;
+
+        while (cluster != 0 && cluster < end) {
+            run = fat_bitmap_run(bitmap, cluster, count);
+            if (run > *len) {
+                best = cluster;
+                *len = run;
+                if (run == count)
+                    return best;
+            }
+            cluster = fat_bitmap_find_from(bitmap, cluster + run);
+        }
+    }
+
+    return best;
+}
+
+void fat_bitmap_fini(fat_bitmap_t *bitmap)
+{
+    free(bitmap->words);
+    free(bitmap->summary);
+    free(bitmap);
+}
@@ -0,0 +1,234 @@
+#include <include/fat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Linux UIO_MAXIOV, longer vectors are split
+#define BLKDEV_IOV_MAX      1024
+
+blkdev_t *blkdev_alloc(const blkdev_ops_t *ops)
+{
+    blkdev_t *dev;
+
+    dev = malloc(sizeof(*dev));
+    if (dev == NULL) {
+        puts("Malloc error: not enough space to allocate block device");
+        return NULL;
+    }
+    dev->ops = ops;
+    dev->fd = -1;
+    dev->base = NULL;
+    dev->size = 0;
+
+    return dev;
+}
+
+// Positional I/O backend, no seek state shared between calls
+
+uint8_t blkdev_fd_read(blkdev_t *dev, uint64_t offset, uint8_t *buffer, size_t size)
+{
+    ssize_t ret;
+
+    while (size > 0) {
+        ret = pread(dev->fd, buffer, size, offset);
+        if (ret <= 0)
+            return FS_ERROR;
+        buffer += ret;
+        offset += ret;
+        size -= ret;
+    }
+
+    return 0;
+}
+
+uint8_t blkdev_fd_write(blkdev_t *dev, uint64_t offset, uint8_t *buffer, size_t size)
+{
+    ssize_t ret;
+
+    while (size > 0) {
+        ret = pwrite(dev->fd, buffer, size, offset);
+        if (ret <= 0)
+            return FS_ERROR;
+        buffer += ret;
+        offset += ret;
+        size -= ret;
+    }
+
+    return 0;
+}
+
+uint8_t blkdev_fd_writev(blkdev_t *dev, uint64_t offset, struct iovec *iov, int count)
+{
+    ssize_t ret;
+
+    while (count > 0) {
+        ret = pwritev(dev->fd, iov, count < BLKDEV_IOV_MAX ? count : BLKDEV_IOV_MAX, offset);
+        if (ret <= 0)
+            return FS_ERROR;
+        offset += ret;
+
+        // Drop the vectors written in full and trim a partially written one
+        while (count > 0 && (size_t) ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (uint8_t *) iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+
+    return 0;
+}
+
+void blkdev_fd_close(blkdev_t *dev)
+{
+    fsync(dev->fd);
+    free(dev);
+}
+
+const blkdev_ops_t blkdev_fd_ops = {
+    .read = blkdev_fd_read,
+    .write = blkdev_fd_write,
+    .writev = blkdev_fd_writev,
+    .map = NULL,
+    .close = blkdev_fd_close,
+};
+
+blkdev_t *blkdev_fd_open(int fd)
+{
+    blkdev_t *dev;
+    struct stat st;
+
+    if (fstat(fd, &st) != 0) {
+        puts("Disk error: cannot stat block device");
+        return NULL;
+    }
+
+    dev = blkdev_alloc(&blkdev_fd_ops);
+    if (dev == NULL)
+        return NULL;
+    dev->fd = fd;
+    dev->size = st.st_size;
+
+    return dev;
+}
+
+// Memory backends, shared by RAM images and mmap'd files
+
+uint8_t blkdev_mem_read(blkdev_t *dev, uint64_t offset, uint8_t *buffer, size_t size)
+{
+    if (offset + size > dev->size)
+        return FS_ERROR;
+
+    memcpy(buffer, dev->base + offset, size);
+    return 0;
+}
+
+uint8_t blkdev_mem_write(blkdev_t *dev, uint64_t offset, uint8_t *buffer, size_t size)
+{
+    if (offset + size > dev->size)
+        return FS_ERROR;
+
+    // Cache lines may already point into the device memory
+    if (dev->base + offset != buffer)
+        memmove(dev->base + offset, buffer, size);
+    return 0;
+}
+
+uint8_t blkdev_mem_writev(blkdev_t *dev, uint64_t offset, struct iovec *iov, int count)
+{
+    for (int i=0; i < count; i++) {
+        if (blkdev_mem_write(dev, offset, iov[i].iov_base, iov[i].iov_len) != 0)
+            return FS_ERROR;
+        offset += iov[i].iov_len;
+    }
+
+    return 0;
+}
+
+uint8_t *blkdev_mem_map(blkdev_t *dev, uint64_t offset, size_t size)
+{
+    if (offset + size > dev->size)
+        return NULL;
+
+    return dev->base + offset;
+}
+
+void blkdev_mem_close(blkdev_t *dev)
+{
+    free(dev);
+}
+
+const blkdev_ops_t blkdev_mem_ops = {
+    .read = blkdev_mem_read,
+    .write = blkdev_mem_write,
+    .writev = blkdev_mem_writev,
+    .map = blkdev_mem_map,
+    .close = blkdev_mem_close,
+};
+
+blkdev_t *blkdev_mem_open(uint8_t *buffer, uint64_t size)
+{
+    blkdev_t *dev;
+
+    dev = blkdev_alloc(&blkdev_mem_ops);
+    if (dev == NULL)
+        return NULL;
+    dev->base = buffer;
+    dev->size = size;
+
+    return dev;
+}
+
+void blkdev_mmap_close(blkdev_t *dev)
+{
+    msync(dev->base, dev->size, MS_SYNC);
+    munmap(dev->base, dev->size);
+    free(dev);
+}
+
+const blkdev_ops_t blkdev_mmap_ops = {
+    .read = blkdev_mem_read,
+    .write = blkdev_mem_write,
+    .writev = blkdev_mem_writev,
+    .map = blkdev_mem_map,
+    .close = blkdev_mmap_close,
+};
+
+blkdev_t *blkdev_mmap_open(int fd)
+{
+    blkdev_t *dev;
+    struct stat st;
+    void *base;
+
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        puts("Disk error: cannot stat block device");
+        return NULL;
+    }
+
+    base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        puts("Disk error: cannot map block device");
+        return NULL;
+    }
+
+    dev = blkdev_alloc(&blkdev_mmap_ops);
+    if (dev == NULL) {
+        munmap(base, st.st_size);
+        return NULL;
+    }
+    dev->fd = fd;
+    dev->base = base;
+    dev->size = st.st_size;
+
+    return dev;
+}
+
+void blkdev_close(blkdev_t *dev)
+{
+    dev->ops->close(dev);
+}
@@ -1,29 +1,171 @@
 #include <stdlib.h>
+#include <string.h>
 #include <include/fat.h>
 
-cache_t *cache_init(size_t cache_size, size_t block_size, uint8_t *(*read_fun)(fat_fs_t *, uint32_t), void (*write_fun) (fat_fs_t *, uint32_t, uint8_t *))
+#define NO_LINE             (-1)
+#define CACHE_PREFETCH_MAX  64
+#define CACHE_WRITE_RUN     256
+#define CACHE_SHARDS        16      // Power of two, at most 64
+#define CACHE_SHARD_MIN     16      // Fewer lines per shard would thrash
+#define CACHE_SHARD_SHIFT   3       // Runs of 8 sectors stay in one shard
+#define CACHE_LINES_MIN     16      // A budget never shrinks the cache below this
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define CACHE_LE16(X)       __builtin_bswap16(X)
+#define CACHE_LE32(X)       __builtin_bswap32(X)
+#else
+#define CACHE_LE16(X)       (X)
+#define CACHE_LE32(X)       (X)
+#endif
+
+#define CACHE_STAT_ADD(FS, TAG, FIELD)  __atomic_fetch_add(&cache_stats_for(FS, TAG)->FIELD, 1, __ATOMIC_RELAXED)
+
+cache_stats_t *cache_stats_for(fat_fs_t *fs, uint32_t tag)
+{
+    if (tag < fs->info.data_region)
+        return &fs->stats.fat_cache;
+
+    return &fs->stats.data_cache;
+}
+
+uint8_t cache_shard_init(cache_shard_t *shard, size_t cache_size, size_t block_size)
+{
+    shard->cache_size = cache_size;
+    shard->slab = NULL;
+    shard->buckets = NULL;
+    shard->iov = NULL;
+    pthread_mutex_init(&shard->lock, NULL);
+
+    shard->lines = cache_lines_create(cache_size);
+    if (shard->lines == NULL)
+        return FS_ERROR;
+
+    // Every line buffer lives in one slab, a miss never touches the allocator
+    shard->slab = malloc(cache_size * block_size);
+    if (shard->slab == NULL) {
+        puts("Malloc error: not enough space to allocate cache slab");
+        return FS_ERROR;
+    }
+
+    // Bucket count is the smallest power of two holding every line
+    for (shard->bucket_count = 1; shard->bucket_count < cache_size; shard->bucket_count <<= 1);
+    shard->buckets = malloc(sizeof(*shard->buckets) * shard->bucket_count);
+    shard->iov = malloc(sizeof(*shard->iov) * (cache_size < CACHE_WRITE_RUN ? cache_size : CACHE_WRITE_RUN));
+    if (shard->buckets == NULL || shard->iov == NULL) {
+        puts("Malloc error: not enough space to allocate cache buckets");
+        return FS_ERROR;
+    }
+    for (size_t i=0; i < shard->bucket_count; i++)
+        shard->buckets[i] = NO_LINE;
+
+    // Every line starts invalid and chained in the LRU list
+    for (size_t i=0; i < cache_size; i++) {
+        shard->lines[i].prev = (int) i - 1;
+        shard->lines[i].next = (i + 1 < cache_size) ? (int) i + 1 : NO_LINE;
+    }
+    shard->lru_head = 0;
+    shard->lru_tail = cache_size - 1;
+
+    return 0;
+}
+
+cache_t *cache_init(size_t cache_size, size_t block_size, uint8_t *(*read_fun)(fat_fs_t *, uint32_t, uint8_t *), uint8_t (*writev_fun) (fat_fs_t *, uint32_t, struct iovec *, int))
 {
     cache_t *cache;
+    size_t lines;
 
-    cache = malloc(sizeof(*cache));
+    cache = calloc(1, sizeof(*cache));
     if (cache == NULL) {
         puts("Malloc error: not enough space to allocate cache");
         return NULL;
     }
     cache->cache_size = cache_size;
     cache->block_size = block_size;
-    cache->lines = cache_lines_create(cache_size);
-    if (cache->lines == NULL) {
-        free(cache);
+    cache->read = read_fun;
+    cache->writev = writev_fun;
+    pthread_mutex_init(&cache->prefetch_lock, NULL);
+
+    for (cache->shard_count = CACHE_SHARDS;
+         cache->shard_count > 1 && cache_size / cache->shard_count < CACHE_SHARD_MIN;
+         cache->shard_count >>= 1);
+    cache->shards = aligned_alloc(_Alignof(cache_shard_t), sizeof(*cache->shards) * cache->shard_count);
+    if (cache->shards == NULL) {
+        puts("Malloc error: not enough space to allocate cache shards");
+        cache->shard_count = 0;
+        cache_fini(cache);
         return NULL;
     }
 
-    cache->read = read_fun;
-    cache->write = write_fun;
+    for (size_t i=0; i < cache->shard_count; i++) {
+        lines = cache_size / cache->shard_count + (i < cache_size % cache->shard_count);
+        if (cache_shard_init(&cache->shards[i], lines, block_size) != 0) {
+            cache->shard_count = i + 1;
+            cache_fini(cache);
+            return NULL;
+        }
+    }
+
+    // Readahead lands here before being spread over the lines, NULL disables it.
+    // It never fills more than half the cache, the buffer is sized to match
+    cache->prefetch_max = cache_size / 2 < CACHE_PREFETCH_MAX ? cache_size / 2 : CACHE_PREFETCH_MAX;
+    cache->prefetch = malloc(cache->prefetch_max * block_size);
+
+    // A flush may have every line in flight at once, each run in its own request
+    cache->iov = malloc(sizeof(*cache->iov) * cache_size);
+    cache->flush_tags = malloc(sizeof(*cache->flush_tags) * cache_size);
+    cache->flush_reqs = malloc(sizeof(*cache->flush_reqs) * cache_size);
+    if (cache->iov == NULL || cache->flush_tags == NULL || cache->flush_reqs == NULL) {
+        puts("Malloc error: not enough space to allocate cache write-back lists");
+        cache_fini(cache);
+        return NULL;
+    }
 
     return cache;
 }
 
+// Bytes a line costs: its buffer, its slot in the line table, hash buckets and write-back lists
+size_t cache_line_cost(size_t block_size)
+{
+    return block_size + sizeof(cache_line_t) + 2 * sizeof(int) + 2 * sizeof(struct iovec) +
+           sizeof(uint32_t) + sizeof(aio_req_t);
+}
+
+// Lines a cache can have within budget bytes, prefetch buffer included
+size_t cache_lines_for(size_t budget, size_t block_size)
+{
+    size_t fixed = sizeof(cache_t) + CACHE_SHARDS * sizeof(cache_shard_t);
+    size_t cost = cache_line_cost(block_size);
+    size_t lines = 0;
+
+    // Below 2 * CACHE_PREFETCH_MAX lines every line pays for half a prefetch block
+    if (budget > fixed + CACHE_PREFETCH_MAX * block_size)
+        lines = (budget - fixed - CACHE_PREFETCH_MAX * block_size) / cost;
+    if (lines < 2 * CACHE_PREFETCH_MAX && budget > fixed)
+        lines = (budget - fixed) / (cost + block_size / 2);
+
+    return lines < CACHE_LINES_MIN ? CACHE_LINES_MIN : lines;
+}
+
+// Bytes allocated by the cache
+size_t cache_mem_size(cache_t *cache)
+{
+    size_t size;
+
+    size = sizeof(*cache) + cache->shard_count * sizeof(*cache->shards);
+    size += cache->cache_size * (sizeof(*cache->iov) + sizeof(*cache->flush_tags) + sizeof(*cache->flush_reqs));
+    if (cache->prefetch != NULL)
+        size += cache->prefetch_max * cache->block_size;
+
+    for (size_t i=0; i < cache->shard_count; i++) {
+        size += cache->shards[i].cache_size * (cache->block_size + sizeof(cache_line_t));
+        size += cache->shards[i].bucket_count * sizeof(int);
+        size += (cache->shards[i].cache_size < CACHE_WRITE_RUN ? cache->shards[i].cache_size : CACHE_WRITE_RUN) *
+                sizeof(struct iovec);
+    }
+
+    return size;
+}
+
 cache_line_t *cache_lines_create(size_t line_count)
 {
     cache_line_t *cache_lines;
@@ -36,89 +178,577 @@ cache_line_t *cache_lines_create(size_t line_count)
 
     for (size_t i=0; i < line_count; i++) {
         cache_lines[i].valid = 0;
-        cache_lines[i].tag = -1;
+        cache_lines[i].dirty = 0;
+        cache_lines[i].tag = 0;
         cache_lines[i].data = NULL;
+        cache_lines[i].hnext = NO_LINE;
     }
 
     return cache_lines;
 }
 
-uint8_t cache_access(cache_t *cache, fat_fs_t *fs, uint32_t sector, uint32_t offset, uint8_t data, uint8_t mode)
+size_t cache_shard_index(cache_t *cache, uint32_t tag)
+{
+    return (tag >> CACHE_SHARD_SHIFT) & (cache->shard_count - 1);
+}
+
+cache_shard_t *cache_shard_of(cache_t *cache, uint32_t tag)
+{
+    return &cache->shards[cache_shard_index(cache, tag)];
+}
+
+// Shards holding [tag, tag + count), always locked in index order
+uint64_t cache_shard_mask(cache_t *cache, uint32_t tag, uint32_t count)
+{
+    uint64_t mask = 0;
+
+    for (uint32_t i=0; i < count; i += (1 << CACHE_SHARD_SHIFT) - (tag + i) % (1 << CACHE_SHARD_SHIFT))
+        mask |= (uint64_t) 1 << cache_shard_index(cache, tag + i);
+
+    return mask;
+}
+
+void cache_lock_mask(cache_t *cache, uint64_t mask)
+{
+    for (size_t i=0; i < cache->shard_count; i++)
+        if (mask & ((uint64_t) 1 << i))
+            pthread_mutex_lock(&cache->shards[i].lock);
+}
+
+void cache_unlock_mask(cache_t *cache, uint64_t mask)
+{
+    for (size_t i=0; i < cache->shard_count; i++)
+        if (mask & ((uint64_t) 1 << i))
+            pthread_mutex_unlock(&cache->shards[i].lock);
+}
+
+size_t cache_hash(cache_shard_t *shard, uint32_t tag)
+{
+    return (tag * 2654435761u) & (shard->bucket_count - 1);
+}
+
+void cache_lru_unlink(cache_shard_t *shard, int index)
+{
+    cache_line_t *line = &shard->lines[index];
+
+    if (line->prev != NO_LINE)
+        shard->lines[line->prev].next = line->next;
+    else
+        shard->lru_head = line->next;
+
+    if (line->next != NO_LINE)
+        shard->lines[line->next].prev = line->prev;
+    else
+        shard->lru_tail = line->prev;
+}
+
+void cache_lru_push_front(cache_shard_t *shard, int index)
+{
+    cache_line_t *line = &shard->lines[index];
+
+    line->prev = NO_LINE;
+    line->next = shard->lru_head;
+    if (shard->lru_head != NO_LINE)
+        shard->lines[shard->lru_head].prev = index;
+    shard->lru_head = index;
+    if (shard->lru_tail == NO_LINE)
+        shard->lru_tail = index;
+}
+
+void cache_hash_remove(cache_shard_t *shard, int index)
+{
+    int *link;
+
+    link = &shard->buckets[cache_hash(shard, shard->lines[index].tag)];
+    while (*link != NO_LINE && *link != index)
+        link = &shard->lines[*link].hnext;
+
+    if (*link == index)
+        *link = shard->lines[index].hnext;
+    shard->lines[index].hnext = NO_LINE;
+}
+
+int cache_lookup(cache_shard_t *shard, uint32_t tag)
+{
+    int index;
+
+    index = shard->buckets[cache_hash(shard, tag)];
+    while (index != NO_LINE && shard->lines[index].tag != tag)
+        index = shard->lines[index].hnext;
+
+    return index;
+}
+
+// Lines [tag, tag + count) must all be cached, dirty and in locked shards,
+// they are marked clean and gathered in iov for one vectored write
+void cache_gather_lines(cache_t *cache, fat_fs_t *fs, uint32_t tag, uint32_t count, struct iovec *iov)
 {
-    int tag;
+    cache_shard_t *shard;
+    cache_line_t *line;
+
+    for (uint32_t i=0; i < count; i++) {
+        shard = cache_shard_of(cache, tag + i);
+        line = &shard->lines[cache_lookup(shard, tag + i)];
+        iov[i].iov_base = line->data;
+        iov[i].iov_len = cache->block_size;
+        line->dirty = 0;
+        CACHE_STAT_ADD(fs, tag + i, writebacks);
+    }
+}
+
+// A failed write leaves the gathered lines dirty again, nothing is lost
+void cache_redirty_lines(cache_t *cache, uint32_t tag, uint32_t count)
+{
+    cache_shard_t *shard;
     int index;
 
-    tag = sector + (offset / cache->block_size);
-    index = tag % cache->cache_size;
+    for (uint32_t i=0; i < count; i++) {
+        shard = cache_shard_of(cache, tag + i);
+        index = cache_lookup(shard, tag + i);
+        if (index != NO_LINE)
+            shard->lines[index].dirty = 1;
+    }
+}
 
-    if (cache->lines[index].tag != tag) {
-        if (cache->lines[index].valid != 0)
-            free(cache->lines[index].data);
-        
-        cache->lines[index].data = cache->read(fs, tag);
-        if (cache->lines[index].data != NULL) {
-            cache->lines[index].tag = tag;
-            cache->lines[index].valid = 1;
-        } 
-        else
-            cache->lines[index].valid = 0;
+uint8_t cache_write_lines(cache_t *cache, fat_fs_t *fs, uint32_t tag, uint32_t count, struct iovec *iov)
+{
+    cache_gather_lines(cache, fs, tag, count, iov);
+    if (cache->writev(fs, tag, iov, count) != 0) {
+        cache_redirty_lines(cache, tag, count);
+        return FS_ERROR;
     }
 
-    if (cache->lines[index].valid == 0)
+    return 0;
+}
+
+uint8_t cache_dirty(cache_t *cache, cache_shard_t *shard, uint32_t tag)
+{
+    int index;
+
+    if (cache_shard_of(cache, tag) != shard)
+        return 0;
+
+    index = cache_lookup(shard, tag);
+    return index != NO_LINE && shard->lines[index].dirty;
+}
+
+// Write back line along with the dirty lines of its shard adjacent to it on disk
+uint8_t cache_line_writeback(cache_t *cache, cache_shard_t *shard, fat_fs_t *fs, cache_line_t *line)
+{
+    uint32_t first;
+    uint32_t count = 1;
+    uint32_t max;
+
+    if (!line->valid || !line->dirty)
         return 0;
 
+    max = shard->cache_size < CACHE_WRITE_RUN ? shard->cache_size : CACHE_WRITE_RUN;
+    first = line->tag;
+    while (count < max && first > 0 && cache_dirty(cache, shard, first - 1)) {
+        first--;
+        count++;
+    }
+    while (count < max && cache_dirty(cache, shard, first + count))
+        count++;
+
+    return cache_write_lines(cache, fs, first, count, shard->iov);
+}
+
+// Free the least recently used line of the shard for a new tag,
+// NO_LINE when it is dirty and cannot be written back
+int cache_recycle(cache_t *cache, cache_shard_t *shard, fat_fs_t *fs)
+{
+    cache_line_t *line;
+    int index;
+
+    index = shard->lru_tail;
+    line = &shard->lines[index];
+    if (line->valid) {
+        if (cache_line_writeback(cache, shard, fs, line) != 0)
+            return NO_LINE;
+        CACHE_STAT_ADD(fs, line->tag, evictions);
+        cache_hash_remove(shard, index);
+        line->valid = 0;
+    }
+
+    return index;
+}
+
+void cache_insert(cache_shard_t *shard, int index, uint32_t tag)
+{
+    cache_line_t *line = &shard->lines[index];
+    size_t bucket;
+
+    line->tag = tag;
+    line->valid = 1;
+    line->dirty = 0;
+    bucket = cache_hash(shard, tag);
+    line->hnext = shard->buckets[bucket];
+    shard->buckets[bucket] = index;
+
+    cache_lru_unlink(shard, index);
+    cache_lru_push_front(shard, index);
+}
+
+// shard->lock held, the line is only valid until it is released
+cache_line_t *cache_get_line(cache_t *cache, cache_shard_t *shard, fat_fs_t *fs, uint32_t tag)
+{
+    cache_line_t *line;
+    int index;
+
+    index = cache_lookup(shard, tag);
+    if (index != NO_LINE) {
+        CACHE_STAT_ADD(fs, tag, hits);
+        cache_lru_unlink(shard, index);
+        cache_lru_push_front(shard, index);
+        return &shard->lines[index];
+    }
+
+    // Miss: recycle the least recently used line
+    CACHE_STAT_ADD(fs, tag, misses);
+    index = cache_recycle(cache, shard, fs);
+    if (index == NO_LINE)
+        return NULL;
+    line = &shard->lines[index];
+
+    // The read callback may hand back device memory instead of filling the slot
+    line->data = cache->read(fs, tag, shard->slab + index * cache->block_size);
+    if (line->data == NULL)
+        return NULL;
+
+    cache_insert(shard, index, tag);
+
+    return line;
+}
+
+uint8_t cache_contains(cache_t *cache, uint32_t tag)
+{
+    cache_shard_t *shard = cache_shard_of(cache, tag);
+    uint8_t found;
+
+    pthread_mutex_lock(&shard->lock);
+    found = cache_lookup(shard, tag) != NO_LINE;
+    pthread_mutex_unlock(&shard->lock);
+
+    return found;
+}
+
+// Fill the missing lines of [tag, tag + count) with a single device read
+void cache_prefetch(cache_t *cache, fat_fs_t *fs, uint32_t tag, uint32_t count)
+{
+    cache_shard_t *shard;
+    cache_line_t *victim;
+    uint64_t mask;
+    uint8_t *data;
+    int index;
+
+    // Mapped devices are served in place, there is nothing to batch
+    if (cache->prefetch == NULL || map_sectors(fs, tag, 1) != NULL)
+        return;
+
+    if (count > cache->prefetch_max)
+        count = cache->prefetch_max;
+
+    // Readahead is only a hint, skip it while another thread owns the buffer
+    if (pthread_mutex_trylock(&cache->prefetch_lock) != 0)
+        return;
+
+    // Shards stay locked across the read, nothing in the range is written back under it
+    mask = cache_shard_mask(cache, tag, count);
+    cache_lock_mask(cache, mask);
+
+    while (count > 0 && cache_lookup(cache_shard_of(cache, tag), tag) != NO_LINE) {
+        tag++;
+        count--;
+    }
+    while (count > 0 && cache_lookup(cache_shard_of(cache, tag + count - 1), tag + count - 1) != NO_LINE)
+        count--;
+
+    // Lines cached in between may be dirty and stay authoritative
+    if (count > 0 && read_sectors_into(fs, tag, count, cache->prefetch) == 0) {
+        for (uint32_t i=0; i < count; i++) {
+            shard = cache_shard_of(cache, tag + i);
+            if (cache_lookup(shard, tag + i) != NO_LINE)
+                continue;
+
+            // The victim may lie further on in the range, its data is newer than the read
+            victim = &shard->lines[shard->lru_tail];
+            if (victim->valid && victim->tag - tag > i && victim->tag - tag < count)
+                memcpy(cache->prefetch + (victim->tag - tag) * cache->block_size, victim->data, cache->block_size);
+
+            index = cache_recycle(cache, shard, fs);
+            if (index == NO_LINE)
+                break;
+            data = shard->slab + index * cache->block_size;
+            memcpy(data, cache->prefetch + i * cache->block_size, cache->block_size);
+            shard->lines[index].data = data;
+            cache_insert(shard, index, tag + i);
+            CACHE_STAT_ADD(fs, tag + i, prefetched);
+        }
+    }
+
+    cache_unlock_mask(cache, mask);
+    pthread_mutex_unlock(&cache->prefetch_lock);
+}
+
+// Copy len bytes at offset in sector tag, which must not cross the line
+uint8_t cache_span(cache_t *cache, fat_fs_t *fs, uint32_t tag, uint32_t offset, uint8_t *buffer, size_t len, uint8_t mode)
+{
+    cache_shard_t *shard = cache_shard_of(cache, tag);
+    cache_line_t *line;
+
+    pthread_mutex_lock(&shard->lock);
+    line = cache_get_line(cache, shard, fs, tag);
+    if (line == NULL) {
+        pthread_mutex_unlock(&shard->lock);
+        return FS_ERROR;
+    }
+
     if (mode == CACHE_READ)
-        return cache->lines[index].data[offset % cache->block_size];
-    else if (mode == CACHE_WRITE)
-        cache->lines[index].data[offset % cache->block_size] = data;
+        memcpy(buffer, line->data + offset, len);
+    else {
+        memcpy(line->data + offset, buffer, len);
+        line->dirty = 1;
+    }
+    pthread_mutex_unlock(&shard->lock);
 
     return 0;
 }
 
+// Byte span at offset from sector, one line at a time
+uint8_t cache_move(cache_t *cache, fat_fs_t *fs, uint32_t sector, uint32_t offset, uint8_t *buffer, size_t len, uint8_t mode)
+{
+    uint32_t tag = sector + offset / cache->block_size;
+    size_t in_line = offset % cache->block_size;
+    size_t n;
+
+    while (len > 0) {
+        n = cache->block_size - in_line;
+        if (n > len)
+            n = len;
+        if (cache_span(cache, fs, tag, in_line, buffer, n, mode) != 0)
+            return FS_ERROR;
+
+        buffer += n;
+        len -= n;
+        in_line = 0;
+        tag++;
+    }
+
+    return 0;
+}
+
+uint8_t cache_get(cache_t *cache, fat_fs_t *fs, uint32_t sector, uint32_t offset, uint8_t *buffer, size_t len)
+{
+    return cache_move(cache, fs, sector, offset, buffer, len, CACHE_READ);
+}
+
+uint8_t cache_put(cache_t *cache, fat_fs_t *fs, uint32_t sector, uint32_t offset, uint8_t *buffer, size_t len)
+{
+    return cache_move(cache, fs, sector, offset, buffer, len, CACHE_WRITE);
+}
+
+// Typed accessors resolve their line once, values are little endian on disk
 uint8_t cache_readb(cache_t *cache, fat_fs_t *fs, uint32_t sector, uint32_t offset)
 {
-    return cache_access(cache, fs, sector, offset, 0, CACHE_READ);
+    uint8_t value = 0;
+
+    cache_get(cache, fs, sector, offset, &value, sizeof(value));
+    return value;
+}
+
+uint16_t cache_readw(cache_t *cache, fat_fs_t *fs, uint32_t sector, uint32_t offset)
+{
+    uint16_t value = 0;
+
+    cache_get(cache, fs, sector, offset, (uint8_t *) &value, sizeof(value));
+    return CACHE_LE16(value);
 }
 
 uint32_t cache_readl(cache_t *cache, fat_fs_t *fs, uint32_t sector, uint32_t offset)
 {
-    return (cache_readb(cache, fs, sector, offset)     +
-    (cache_readb(cache, fs, sector, offset + 1) << 8)  +
-    (cache_readb(cache, fs, sector, offset + 2) << 16) +
-    (cache_readb(cache, fs, sector, offset + 3) << 24));
+    uint32_t value = 0;
+
+    cache_get(cache, fs, sector, offset, (uint8_t *) &value, sizeof(value));
+    return CACHE_LE32(value);
 }
 
 void cache_writeb(cache_t *cache, fat_fs_t *fs, uint32_t sector, uint32_t offset, uint8_t data)
 {
-    cache_access(cache, fs, sector, offset, data, CACHE_WRITE);
+    cache_put(cache, fs, sector, offset, &data, sizeof(data));
+}
+
+void cache_writew(cache_t *cache, fat_fs_t *fs, uint32_t sector, uint32_t offset, uint16_t data)
+{
+    data = CACHE_LE16(data);
+    cache_put(cache, fs, sector, offset, (uint8_t *) &data, sizeof(data));
 }
 
 void cache_writel(cache_t *cache, fat_fs_t *fs, uint32_t sector, uint32_t offset, uint32_t data)
 {
-    cache_writeb(cache, fs, sector, offset, data);
-    cache_writeb(cache, fs, sector, offset + 1, data >> 8);
-    cache_writeb(cache, fs, sector, offset + 2, data >> 16);
-    cache_writeb(cache, fs, sector, offset + 3, data >> 24);
+    data = CACHE_LE32(data);
+    cache_put(cache, fs, sector, offset, (uint8_t *) &data, sizeof(data));
 }
 
-void cache_flush(cache_t *cache, fat_fs_t *fs)
+int cache_tag_cmp(const void *a, const void *b)
 {
-    for (size_t i=0; i < cache->cache_size; i++)
-        if (cache->lines[i].valid && cache->lines[i].tag != -1)
-            cache->write(fs, cache->lines[i].tag, cache->lines[i].data);
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+
+    return (x > y) - (x < y);
 }
 
-void cache_lines_destroy(cache_line_t *cache_lines, size_t line_count)
+// Dirty lines go out in LBA order, adjacent ones merged into a single write
+// across shard boundaries, and every write is queued before waiting on any.
+// On failure every line of the pass is dirty again for the next one
+uint8_t cache_flush(cache_t *cache, fat_fs_t *fs)
 {
-    for (size_t i=0; i < line_count; i++)
-        if (cache_lines[i].data != NULL)
-            free(cache_lines[i].data);
+    cache_shard_t *shard;
+    aio_batch_t batch;
+    uint64_t mask;
+    uint8_t status = 0;
+    size_t dirty = 0;
+    size_t reqs = 0;
+    size_t max;
+    size_t run;
+
+    mask = cache->shard_count == 64 ? ~(uint64_t) 0 : ((uint64_t) 1 << cache->shard_count) - 1;
+    cache_lock_mask(cache, mask);
 
+    for (size_t s=0; s < cache->shard_count; s++) {
+        shard = &cache->shards[s];
+        for (size_t i=0; i < shard->cache_size; i++)
+            if (shard->lines[i].valid && shard->lines[i].dirty)
+                cache->flush_tags[dirty++] = shard->lines[i].tag;
+    }
+    qsort(cache->flush_tags, dirty, sizeof(*cache->flush_tags), cache_tag_cmp);
+    aio_batch_init(&batch);
+
+    max = cache->cache_size < CACHE_WRITE_RUN ? cache->cache_size : CACHE_WRITE_RUN;
+    for (size_t i=0; i < dirty; i += run) {
+        for (run = 1; i + run < dirty && run < max &&
+             cache->flush_tags[i + run] == cache->flush_tags[i] + run; run++);
+        cache_gather_lines(cache, fs, cache->flush_tags[i], run, cache->iov + i);
+        if (write_sectors_vec_submit(fs, cache->flush_tags[i], cache->iov + i, run, &cache->flush_reqs[reqs++], &batch) != 0)
+            status = FS_ERROR;
+    }
+    if (fat_fs_io_wait(fs, &batch) != 0)
+        status = FS_ERROR;
+
+    // Requests of a batch fail as a whole, the sorted tags tell which lines went out
+    if (status != 0)
+        for (size_t i=0; i < dirty; i++)
+            cache_redirty_lines(cache, cache->flush_tags[i], 1);
+
+    cache_unlock_mask(cache, mask);
+    return status;
+}
+
+// Write back dirty lines in [tag, tag + count) before the range is read around the cache
+uint8_t cache_sync_range(cache_t *cache, fat_fs_t *fs, uint32_t tag, uint32_t count)
+{
+    cache_shard_t *shard;
+    uint8_t status = 0;
+    int index;
+
+    if (count > cache->cache_size) {
+        for (size_t s=0; s < cache->shard_count; s++) {
+            shard = &cache->shards[s];
+            pthread_mutex_lock(&shard->lock);
+            for (size_t i=0; i < shard->cache_size; i++)
+                if (shard->lines[i].tag - tag < count && cache_line_writeback(cache, shard, fs, &shard->lines[i]) != 0)
+                    status = FS_ERROR;
+            pthread_mutex_unlock(&shard->lock);
+        }
+        return status;
+    }
+
+    for (uint32_t i=0; i < count; i++) {
+        shard = cache_shard_of(cache, tag + i);
+        pthread_mutex_lock(&shard->lock);
+        index = cache_lookup(shard, tag + i);
+        if (index != NO_LINE && cache_line_writeback(cache, shard, fs, &shard->lines[index]) != 0)
+            status = FS_ERROR;
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    return status;
+}
+
+void cache_invalidate_line(cache_shard_t *shard, int index)
+{
+    cache_line_t *line = &shard->lines[index];
+
+    if (!line->valid)
+        return;
+
+    cache_hash_remove(shard, index);
+    line->data = NULL;
+    line->valid = 0;
+    line->dirty = 0;
+
+    // Invalid lines are the first to be recycled
+    cache_lru_unlink(shard, index);
+    line->next = NO_LINE;
+    line->prev = shard->lru_tail;
+    if (shard->lru_tail != NO_LINE)
+        shard->lines[shard->lru_tail].next = index;
+    shard->lru_tail = index;
+    if (shard->lru_head == NO_LINE)
+        shard->lru_head = index;
+}
+
+// Drop lines in [tag, tag + count) after the range was overwritten around the cache
+void cache_invalidate_range(cache_t *cache, uint32_t tag, uint32_t count)
+{
+    cache_shard_t *shard;
+    int index;
+
+    if (count > cache->cache_size) {
+        for (size_t s=0; s < cache->shard_count; s++) {
+            shard = &cache->shards[s];
+            pthread_mutex_lock(&shard->lock);
+            for (size_t i=0; i < shard->cache_size; i++)
+                if (shard->lines[i].valid && shard->lines[i].tag - tag < count)
+                    cache_invalidate_line(shard, i);
+            pthread_mutex_unlock(&shard->lock);
+        }
+        return;
+    }
+
+    for (uint32_t i=0; i < count; i++) {
+        shard = cache_shard_of(cache, tag + i);
+        pthread_mutex_lock(&shard->lock);
+        index = cache_lookup(shard, tag + i);
+        if (index != NO_LINE)
+            cache_invalidate_line(shard, index);
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void cache_lines_destroy(cache_line_t *cache_lines)
+{
     free(cache_lines);
 }
 
+void cache_shard_fini(cache_shard_t *shard)
+{
+    pthread_mutex_destroy(&shard->lock);
+    cache_lines_destroy(shard->lines);
+    free(shard->slab);
+    free(shard->buckets);
+    free(shard->iov);
+}
+
 void cache_fini(cache_t *cache)
 {
-    cache_lines_destroy(cache->lines, cache->cache_size);
+    for (size_t i=0; i < cache->shard_count; i++)
+        cache_shard_fini(&cache->shards[i]);
+    free(cache->shards);
+    pthread_mutex_destroy(&cache->prefetch_lock);
+    free(cache->prefetch);
+    free(cache->iov);
+    free(cache->flush_tags);
+    free(cache->flush_reqs);
     free(cache);
-}
\ No newline at end of file
+}
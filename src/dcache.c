@@ -0,0 +1,302 @@
+#include <include/fat.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NO_DENTRY       (-1)
+
+dcache_t *dcache_init(size_t capacity)
+{
+    dcache_t *dcache;
+
+    dcache = malloc(sizeof(*dcache));
+    if (dcache == NULL) {
+        puts("Malloc error: not enough space to allocate path cache");
+        return NULL;
+    }
+
+    for (dcache->bucket_count = 1; dcache->bucket_count < capacity; dcache->bucket_count <<= 1);
+    dcache->capacity = capacity;
+    dcache->hand = 0;
+    pthread_mutex_init(&dcache->lock, NULL);
+    dcache->slots = calloc(capacity, sizeof(*dcache->slots));
+    dcache->buckets = malloc(dcache->bucket_count * sizeof(*dcache->buckets));
+    dcache->parents = malloc(dcache->bucket_count * sizeof(*dcache->parents));
+    if (dcache->slots == NULL || dcache->buckets == NULL || dcache->parents == NULL) {
+        puts("Malloc error: not enough space to allocate path cache");
+        dcache_fini(dcache);
+        return NULL;
+    }
+
+    for (size_t i=0; i < dcache->bucket_count; i++) {
+        dcache->buckets[i] = NO_DENTRY;
+        dcache->parents[i] = NO_DENTRY;
+    }
+
+    return dcache;
+}
+
+// Entries that fit in budget bytes, both bucket arrays included
+size_t dcache_entries_for(size_t budget)
+{
+    return budget / (sizeof(dentry_t) + 4 * sizeof(int));
+}
+
+// Bytes allocated by the path cache
+size_t dcache_mem_size(dcache_t *dcache)
+{
+    return sizeof(*dcache) + dcache->capacity * sizeof(*dcache->slots) +
+           dcache->bucket_count * (sizeof(*dcache->buckets) + sizeof(*dcache->parents));
+}
+
+// Keys are case folded, 8.3 names compare case insensitively
+uint8_t dcache_key(char *path, char *key)
+{
+    size_t i;
+
+    for (i=0; path[i]; i++) {
+        if (i == DCACHE_PATH_LEN - 1)
+            return FS_ERROR;
+        key[i] = (path[i] >= 'a' && path[i] <= 'z') ? path[i] - ('a' - 'A') : path[i];
+    }
+    key[i] = '\0';
+
+    return 0;
+}
+
+uint32_t dcache_hash(char *key)
+{
+    uint32_t hash = 2166136261u;
+
+    while (*key)
+        hash = (hash ^ (uint8_t) *key++) * 16777619u;
+
+    return hash;
+}
+
+int *dcache_parent_bucket(dcache_t *dcache, uint32_t parent)
+{
+    return &dcache->parents[(parent * 2654435761u) & (dcache->bucket_count - 1)];
+}
+
+void dcache_parent_link(dcache_t *dcache, int index)
+{
+    int *bucket;
+
+    bucket = dcache_parent_bucket(dcache, dcache->slots[index].parent);
+    dcache->slots[index].pnext = *bucket;
+    *bucket = index;
+}
+
+void dcache_parent_unlink(dcache_t *dcache, int index)
+{
+    int *link;
+
+    link = dcache_parent_bucket(dcache, dcache->slots[index].parent);
+    while (*link != NO_DENTRY && *link != index)
+        link = &dcache->slots[*link].pnext;
+
+    if (*link == index)
+        *link = dcache->slots[index].pnext;
+}
+
+void dcache_unlink(dcache_t *dcache, int index)
+{
+    int *link;
+
+    dcache_parent_unlink(dcache, index);
+
+    link = &dcache->buckets[dcache->slots[index].hash & (dcache->bucket_count - 1)];
+    while (*link != NO_DENTRY && *link != index)
+        link = &dcache->slots[*link].hnext;
+
+    if (*link == index)
+        *link = dcache->slots[index].hnext;
+    dcache->slots[index].used = 0;
+}
+
+int dcache_find(dcache_t *dcache, char *key, uint32_t hash)
+{
+    int index;
+
+    index = dcache->buckets[hash & (dcache->bucket_count - 1)];
+    while (index != NO_DENTRY &&
+           (dcache->slots[index].hash != hash || strcmp(dcache->slots[index].path, key)))
+        index = dcache->slots[index].hnext;
+
+    return index;
+}
+
+// On a hit the entry is copied out, the slot may be recycled once the lock is dropped
+uint8_t dcache_lookup(dcache_t *dcache, char *path, entry_t *entry)
+{
+    char key[DCACHE_PATH_LEN];
+    dentry_t *dentry;
+    uint8_t ret;
+    int index;
+
+    if (dcache_key(path, key) != 0)
+        return DCACHE_MISS;
+
+    pthread_mutex_lock(&dcache->lock);
+    index = dcache_find(dcache, key, dcache_hash(key));
+    if (index == NO_DENTRY) {
+        pthread_mutex_unlock(&dcache->lock);
+        return DCACHE_MISS;
+    }
+
+    dentry = &dcache->slots[index];
+    dentry->referenced = 1;
+    ret = dentry->negative ? DCACHE_NEGATIVE : DCACHE_HIT;
+    if (!dentry->negative)
+        memcpy(entry, &dentry->entry, sizeof(*entry));
+    pthread_mutex_unlock(&dcache->lock);
+
+    return ret;
+}
+
+void dcache_insert(dcache_t *dcache, char *path, uint32_t parent, entry_t *entry)
+{
+    char key[DCACHE_PATH_LEN];
+    dentry_t *dentry;
+    uint32_t hash;
+    int index;
+
+    if (dcache_key(path, key) != 0)
+        return;
+
+    pthread_mutex_lock(&dcache->lock);
+    hash = dcache_hash(key);
+    index = dcache_find(dcache, key, hash);
+    if (index == NO_DENTRY) {
+        // Clock sweep: skip recently referenced slots once
+        while (dcache->slots[dcache->hand].used && dcache->slots[dcache->hand].referenced) {
+            dcache->slots[dcache->hand].referenced = 0;
+            dcache->hand = (dcache->hand + 1) % dcache->capacity;
+        }
+        index = dcache->hand;
+        dcache->hand = (dcache->hand + 1) % dcache->capacity;
+
+        if (dcache->slots[index].used)
+            dcache_unlink(dcache, index);
+
+        dentry = &dcache->slots[index];
+        strcpy(dentry->path, key);
+        dentry->hash = hash;
+        dentry->hnext = dcache->buckets[hash & (dcache->bucket_count - 1)];
+        dcache->buckets[hash & (dcache->bucket_count - 1)] = index;
+        dentry->parent = parent;
+        dcache_parent_link(dcache, index);
+        dentry->used = 1;
+    }
+
+    dentry = &dcache->slots[index];
+    if (dentry->parent != parent) {
+        dcache_parent_unlink(dcache, index);
+        dentry->parent = parent;
+        dcache_parent_link(dcache, index);
+    }
+    dentry->referenced = 1;
+    dentry->negative = (entry == NULL);
+    if (entry != NULL)
+        memcpy(&dentry->entry, entry, sizeof(*entry));
+    pthread_mutex_unlock(&dcache->lock);
+}
+
+// dcache->lock held
+void dcache_reset(dcache_t *dcache)
+{
+    for (size_t i=0; i < dcache->capacity; i++)
+        dcache->slots[i].used = 0;
+    for (size_t i=0; i < dcache->bucket_count; i++) {
+        dcache->buckets[i] = NO_DENTRY;
+        dcache->parents[i] = NO_DENTRY;
+    }
+}
+
+void dcache_clear(dcache_t *dcache)
+{
+    pthread_mutex_lock(&dcache->lock);
+    dcache_reset(dcache);
+    pthread_mutex_unlock(&dcache->lock);
+}
+
+// Subdirectory an entry names, 0 for files and the . and .. links
+uint32_t dcache_subdir(entry_t *entry)
+{
+    if (entry->attr != DIR_ATTR || entry->short_name[0] == '.')
+        return 0;
+
+    return WORDS_TO_LONG(entry->high_cluster, entry->low_cluster);
+}
+
+// dcache->lock held. Drop every path below the directory starting at parent
+void dcache_drop_tree(dcache_t *dcache, uint32_t parent)
+{
+    uint32_t child;
+    int index;
+
+    index = *dcache_parent_bucket(dcache, parent);
+    while (index != NO_DENTRY) {
+        if (dcache->slots[index].parent != parent) {
+            index = dcache->slots[index].pnext;
+            continue;
+        }
+
+        child = dcache->slots[index].negative ? 0 : dcache_subdir(&dcache->slots[index].entry);
+        dcache_unlink(dcache, index);
+        if (child != 0 && child != parent)
+            dcache_drop_tree(dcache, child);
+        // The subtree may have unlinked our successor, start over on the bucket
+        index = *dcache_parent_bucket(dcache, parent);
+    }
+}
+
+// Mirror a change of the directory starting at parent, old is NULL for a new entry.
+// Paths naming the entry follow it in place, a new name only drops the negative
+// dentries it may answer, a directory deleted or moved to another chain takes
+// every path below it
+void dcache_update(dcache_t *dcache, uint32_t parent, entry_t *old, entry_t *entry)
+{
+    dentry_t *dentry;
+    uint32_t subdir;
+    uint8_t gone;
+    uint8_t named;
+    int index;
+    int next;
+
+    gone = entry->short_name[0] == '\0' || entry->short_name[0] == INVALID_ENTRY;
+    named = !gone && (old == NULL || memcmp(old->short_name, entry->short_name, SHORT_NAME_LEN));
+    subdir = old != NULL ? dcache_subdir(old) : 0;
+    if (!gone && !named && subdir == dcache_subdir(entry))
+        subdir = 0;
+
+    pthread_mutex_lock(&dcache->lock);
+    for (index = *dcache_parent_bucket(dcache, parent); index != NO_DENTRY; index = next) {
+        dentry = &dcache->slots[index];
+        next = dentry->pnext;
+        if (dentry->parent != parent)
+            continue;
+
+        if (dentry->negative) {
+            if (named)
+                dcache_unlink(dcache, index);
+        } else if (old != NULL && !memcmp(dentry->entry.short_name, old->short_name, SHORT_NAME_LEN)) {
+            if (gone || named || subdir != 0)
+                dcache_unlink(dcache, index);
+            else
+                memcpy(&dentry->entry, entry, sizeof(*entry));
+        }
+    }
+    if (subdir != 0 && subdir != parent)
+        dcache_drop_tree(dcache, subdir);
+    pthread_mutex_unlock(&dcache->lock);
+}
+
+void dcache_fini(dcache_t *dcache)
+{
+    pthread_mutex_destroy(&dcache->lock);
+    free(dcache->slots);
+    free(dcache->buckets);
+    free(dcache->parents);
+    free(dcache);
+}
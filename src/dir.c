@@ -2,35 +2,70 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define TOLOWER(C)   ((C >= 'A' && C <= 'Z') ? C + 32 : C) 
+#define TOUPPER(C)   ((C >= 'a' && C <= 'z') ? C - 32 : C)
 
-void entry_array_destroy(entry_t **entries, size_t num_entries)
-{
-    for (size_t i = 0; i < num_entries; i++) {
-        if (entries[i] != NULL)
-            free(entries[i]);
-    }
+#define DIR_INDEX_MIN       16
+#define DIR_ARENA_MIN       64
+#define DIR_SCAN_AFTER      1024    // Slots walked by linear lookups before the directory is scanned
+#define DIR_MAX_SIZE        (65536 * 32)    // FAT caps a directory at 65536 entries
+#define NO_SLOT             (-1)
 
-    free(entries);
+#define DIR_NAME(D, I)      ((D)->names + (I) * SHORT_NAME_LEN)
+
+void dir_arena_destroy(dir_t *dir)
+{
+    free(dir->entries);
+    free(dir->names);
+    free(dir->offsets);
+    free(dir->holes);
+    dir->entries = NULL;
+    dir->names = NULL;
+    dir->offsets = NULL;
+    dir->holes = NULL;
+    dir->capacity = 0;
+    dir->used_entries = 0;
+    dir->hole_count = 0;
+    dir->hole_capacity = 0;
 }
 
-entry_t **entry_array_create(size_t num_entries)
+// Room for count live entries, names and index chain grow together
+uint8_t dir_arena_reserve(dir_t *dir, size_t count)
 {
-    entry_t **entries;
+    size_t capacity;
+    entry_t *entries;
+    uint32_t *offsets;
+    char *names;
+    int *chain;
 
-    entries = calloc(num_entries, sizeof(*entries));
+    if (count <= dir->capacity)
+        return 0;
+
+    for (capacity = dir->capacity ? dir->capacity : DIR_ARENA_MIN; capacity < count; capacity <<= 1);
+
+    entries = realloc(dir->entries, capacity * sizeof(*entries));
     if (entries == NULL)
-        return NULL;
-    
-    for (size_t i = 0; i < num_entries; i++) {
-        entries[i] = calloc(1, sizeof(*entries[i]));
-        if (entries[i] == NULL) {
-            entry_array_destroy(entries, num_entries);
-            return NULL;
-        }
+        return FS_ERROR;
+    dir->entries = entries;
+
+    names = realloc(dir->names, capacity * SHORT_NAME_LEN);
+    if (names == NULL)
+        return FS_ERROR;
+    dir->names = names;
+
+    offsets = realloc(dir->offsets, capacity * sizeof(*offsets));
+    if (offsets == NULL)
+        return FS_ERROR;
+    dir->offsets = offsets;
+
+    if (dir->chain != NULL) {
+        chain = realloc(dir->chain, capacity * sizeof(*chain));
+        if (chain == NULL)
+            return FS_ERROR;
+        dir->chain = chain;
     }
 
-    return entries;
+    dir->capacity = capacity;
+    return 0;
 }
 
 dir_t *dir_init(fat_fs_t *fs, entry_t *entry)
@@ -46,228 +81,789 @@ dir_t *dir_init(fat_fs_t *fs, entry_t *entry)
         return NULL;
     }
 
-    // Alloco il vettore di entry della directory
+    // Le entry vengono allocate solo da dir_scan
     dir->num_entries = raw_size / sizeof(*entry);
-    dir->entries = entry_array_create(dir->num_entries);
-    if (!dir->entries) {
-        free(dir);
-        return NULL;
-    }
+    dir->entries = NULL;
+    dir->names = NULL;
+    dir->offsets = NULL;
+    dir->capacity = 0;
+    dir->used_entries = 0;
+    dir->buckets = NULL;
+    dir->chain = NULL;
+    dir->bucket_count = 0;
+    dir->holes = NULL;
+    dir->hole_count = 0;
+    dir->hole_capacity = 0;
+    dir->end = 0;
+    dir->probed = 0;
+    dir->refs = 1;
+    dir->shared = 0;
 
     // Apro la directory come file
     entry->size = raw_size;
     dir->ident = file_open(fs, entry);
     if (dir->ident == NULL) {
-        entry_array_destroy(dir->entries, dir->num_entries);
         free(dir);
         return NULL;
     }
+    pthread_mutex_init(&dir->lock, NULL);
 
     return dir;
 }
 
-void dir_entry_create(fat_fs_t *fs, dir_t *dir, entry_t *entry)
+dir_t *dir_hold(dir_t *dir)
 {
-    size_t offset = 0;
-    uint8_t entry_tag;
+    __atomic_add_fetch(&dir->refs, 1, __ATOMIC_RELAXED);
+    return dir;
+}
 
-    while (offset < dir->ident->entry->size) {
-        entry_tag = file_readb(dir->ident, fs, offset);
-        if (entry_tag == 0 || entry_tag == (uint8_t) INVALID_ENTRY) {
-            file_write(dir->ident, fs, offset, (uint8_t *) entry, sizeof(*entry));
-            return;
-        }   
-        offset += sizeof(entry_t);
-    }
+// fs->dirs_lock held. Shared dir_t of the directory at cluster, no reference is taken
+dir_t *dir_shared_find(fat_fs_t *fs, uint32_t cluster)
+{
+    if (cluster == 0 || cluster == fs->info.root_cluster)
+        return fs->root_dir;
+
+    for (size_t i=0; i < FS_DIRS_SIZE; i++)
+        if (fs->dirs[i] != NULL && fs->dirs[i]->ident->cluster == cluster)
+            return fs->dirs[i];
+
+    return NULL;
 }
 
-void dir_entry_override(fat_fs_t *fs, dir_t *dir, char *short_name, entry_t *entry)
+// fs->lock held. Shared dir_t of the directory entry points to, so its index outlives
+// a single lookup. entry is consumed on success as by dir_init, dir_close gives the
+// reference back. A private dir_t comes back when every slot is in use
+dir_t *dir_get(fat_fs_t *fs, entry_t *entry)
 {
-    size_t offset = 0;
-    entry_t *curr_entry;
+    uint32_t cluster = WORDS_TO_LONG(entry->high_cluster, entry->low_cluster);
+    dir_t *found;
+    dir_t *dir;
+    size_t slot;
 
-    while (offset < dir->ident->entry->size) {
-        curr_entry = (entry_t *) file_read(dir->ident, fs, offset, sizeof(*curr_entry));
-        if (curr_entry == NULL)
-            return;
+    // ".." of a top level directory points to cluster 0
+    if (cluster == 0 || cluster == fs->info.root_cluster) {
+        if ((dir = fat_fs_root(fs)) == NULL)
+            return NULL;
+        free(entry);
+        return dir_hold(dir);
+    }
 
-        if (!strncmp(curr_entry->short_name, short_name, SHORT_NAME_LEN)) {
-            file_write(dir->ident, fs, offset, (uint8_t *) entry, sizeof(*entry));
-            free(curr_entry);
-            return;
+    pthread_mutex_lock(&fs->dirs_lock);
+    found = dir_shared_find(fs, cluster);
+    if (found != NULL)
+        dir_hold(found);
+    pthread_mutex_unlock(&fs->dirs_lock);
+    if (found != NULL) {
+        free(entry);
+        return found;
+    }
+
+    // Sized outside the lock, the loser of a race drops its copy
+    dir = dir_init(fs, entry);
+    if (dir == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&fs->dirs_lock);
+    found = dir_shared_find(fs, cluster);
+    if (found != NULL) {
+        dir_hold(found);
+        pthread_mutex_unlock(&fs->dirs_lock);
+        dir_close(fs, dir);
+        return found;
+    }
+
+    // Round robin over the slots nobody but fs->dirs holds
+    for (size_t i=0; i < FS_DIRS_SIZE; i++) {
+        slot = fs->dirs_hand++ % FS_DIRS_SIZE;
+        if (fs->dirs[slot] != NULL && __atomic_load_n(&fs->dirs[slot]->refs, __ATOMIC_ACQUIRE) != 1)
+            continue;
+
+        if (fs->dirs[slot] != NULL)
+            dir_close(fs, fs->dirs[slot]);
+        dir->shared = 1;
+        fs->dirs[slot] = dir_hold(dir);
+        break;
+    }
+    pthread_mutex_unlock(&fs->dirs_lock);
+
+    return dir;
+}
+
+// fs->lock held exclusively. A deleted directory leaves fs->dirs, its clusters may be reused
+void dir_shared_drop(fat_fs_t *fs, uint32_t cluster)
+{
+    dir_t *dir = NULL;
+
+    pthread_mutex_lock(&fs->dirs_lock);
+    for (size_t i=0; i < FS_DIRS_SIZE; i++)
+        if (fs->dirs[i] != NULL && fs->dirs[i]->ident->cluster == cluster) {
+            dir = fs->dirs[i];
+            fs->dirs[i] = NULL;
+            break;
         }
+    pthread_mutex_unlock(&fs->dirs_lock);
 
-        offset += sizeof(entry_t);
-        free(curr_entry);
+    if (dir != NULL) {
+        dir->shared = 0;
+        dir_close(fs, dir);
     }
+}
 
-    return;
+void dir_shared_fini(fat_fs_t *fs)
+{
+    for (size_t i=0; i < FS_DIRS_SIZE; i++)
+        if (fs->dirs[i] != NULL) {
+            dir_close(fs, fs->dirs[i]);
+            fs->dirs[i] = NULL;
+        }
 }
 
-entry_t *dir_read_entry(fat_fs_t *fs, dir_t *dir, size_t offset)
+size_t dir_scan_mem_size(dir_t *dir)
 {
-    uint8_t *raw_entry;
-    entry_t *ret;
+    size_t size;
 
-    ret = calloc(1, sizeof(*ret));
-    raw_entry = file_read(dir->ident, fs, offset, sizeof(*ret));
-    strncpy(ret->short_name, (char *) raw_entry, SHORT_NAME_LEN);
-    ret->attr = raw_entry[ATTR_OFFSET];
-    ret->low_cluster = BYTES_TO_WORD(raw_entry, LOW_CLUSTER_OFFSET);
-    ret->ctime = BYTES_TO_LONG(raw_entry, CTIME_OFFSET);
-    ret->atime = BYTES_TO_LONG(raw_entry, ATIME_OFFSET);
-    ret->high_cluster = BYTES_TO_LONG(raw_entry, HIGH_CLUSTER_OFFSET);
-    ret->mtime = BYTES_TO_LONG(raw_entry, MTIME_OFFSET);
-    ret->size = BYTES_TO_LONG(raw_entry, SIZE_OFFSET);
-
-    free(raw_entry);
-    return ret;
+    pthread_mutex_lock(&dir->lock);
+    size = sizeof(*dir) + dir->capacity * (sizeof(*dir->entries) + SHORT_NAME_LEN + sizeof(*dir->offsets)) +
+           dir->hole_capacity * sizeof(*dir->holes);
+    if (dir->chain != NULL)
+        size += dir->capacity * sizeof(*dir->chain) + dir->bucket_count * sizeof(*dir->buckets);
+    pthread_mutex_unlock(&dir->lock);
+
+    return size;
 }
 
-void dir_scan(fat_fs_t *fs, dir_t *dir)
+// Bytes held by the scans of the shared directories
+size_t dir_mem_size(fat_fs_t *fs)
 {
-    size_t offset = 0;
-    uint8_t entry_attr;
-    entry_t *temp_entry;
-
-    for (size_t i=0; offset < dir->ident->entry->size;) {
-        entry_attr = file_readb(dir->ident, fs, offset + ATTR_OFFSET);
-        if (entry_attr == LFN_ATTR)
-            offset += sizeof(entry_t);
-        if (entry_attr != 0) {
-            temp_entry = dir_read_entry(fs, dir, offset);
-            if (temp_entry->short_name[0] != INVALID_ENTRY && temp_entry->short_name[0] != '\0') {
-                if (dir->entries[i] != NULL)
-                    free(dir->entries[i]);
-                dir->entries[i++] = temp_entry;
-            }
-            else 
-                free(temp_entry);
+    size_t size = 0;
+
+    pthread_mutex_lock(&fs->dirs_lock);
+    if (fs->root_dir != NULL)
+        size += dir_scan_mem_size(fs->root_dir);
+    for (size_t i=0; i < FS_DIRS_SIZE; i++)
+        if (fs->dirs[i] != NULL)
+            size += dir_scan_mem_size(fs->dirs[i]);
+    pthread_mutex_unlock(&fs->dirs_lock);
+
+    return size;
+}
+
+// Space padded, upper case 8.3 form of name; fails when name does not fit
+uint8_t short_name_key(char *name, char *key)
+{
+    size_t i;
+    size_t j;
+
+    memset(key, ' ', SHORT_NAME_LEN);
+    if (!strcmp(name, ".") || !strcmp(name, "..")) {
+        memcpy(key, name, strlen(name));
+        return 0;
+    }
+
+    for (i=0; name[i] && name[i] != '.'; i++) {
+        if (i == FILENAME_LEN)
+            return FS_ERROR;
+        key[i] = TOUPPER(name[i]);
+    }
+
+    if (name[i] == '.')
+        for (i++, j=0; name[i]; i++, j++) {
+            if (j == FILE_EXT_LEN || name[i] == '.')
+                return FS_ERROR;
+            key[FILENAME_LEN + j] = TOUPPER(name[i]);
         }
-        offset += sizeof(entry_t);
+
+    return 0;
+}
+
+uint32_t short_name_hash(char *short_name)
+{
+    uint32_t hash = 2166136261u;
+
+    for (size_t i=0; i < SHORT_NAME_LEN; i++)
+        hash = (hash ^ (uint8_t) TOUPPER(short_name[i])) * 16777619u;
+
+    return hash;
+}
+
+int short_name_equal(char *short_name, char *key)
+{
+    for (size_t i=0; i < SHORT_NAME_LEN; i++)
+        if (TOUPPER(short_name[i]) != key[i])
+            return 0;
+
+    return 1;
+}
+
+void dir_index_link(dir_t *dir, size_t slot)
+{
+    size_t bucket;
+
+    bucket = short_name_hash(DIR_NAME(dir, slot)) & (dir->bucket_count - 1);
+    dir->chain[slot] = dir->buckets[bucket];
+    dir->buckets[bucket] = slot;
+}
+
+void dir_index_unlink(dir_t *dir, size_t slot)
+{
+    int *link;
+
+    link = &dir->buckets[short_name_hash(DIR_NAME(dir, slot)) & (dir->bucket_count - 1)];
+    while (*link != NO_SLOT && *link != (int) slot)
+        link = &dir->chain[*link];
+
+    if (*link == (int) slot)
+        *link = dir->chain[slot];
+}
+
+void dir_index_destroy(dir_t *dir)
+{
+    free(dir->buckets);
+    free(dir->chain);
+    dir->buckets = NULL;
+    dir->chain = NULL;
+    dir->bucket_count = 0;
+}
+
+// Only worth it for larger directories, small ones are searched linearly
+void dir_index_build(dir_t *dir)
+{
+    dir_index_destroy(dir);
+    if (dir->used_entries < DIR_INDEX_MIN)
+        return;
+
+    for (dir->bucket_count = 1; dir->bucket_count < dir->used_entries; dir->bucket_count <<= 1);
+    dir->buckets = malloc(dir->bucket_count * sizeof(*dir->buckets));
+    dir->chain = malloc(dir->capacity * sizeof(*dir->chain));
+    if (dir->buckets == NULL || dir->chain == NULL) {
+        dir_index_destroy(dir);
+        return;
     }
+
+    for (size_t i=0; i < dir->bucket_count; i++)
+        dir->buckets[i] = NO_SLOT;
+    for (size_t i=0; i < dir->used_entries; i++)
+        dir_index_link(dir, i);
 }
 
-int strcmp_insensitive(char *a, char *b)
+int dir_find_slot(dir_t *dir, char *key)
 {
-    size_t i = 0;
+    int slot;
 
-    do {
-        if (!a[i] || !b[i])
-            return a[i]-b[i];
-        i++;
-    } while (TOLOWER(a[i]) == TOLOWER(b[i]));
+    if (dir->buckets != NULL) {
+        slot = dir->buckets[short_name_hash(key) & (dir->bucket_count - 1)];
+        while (slot != NO_SLOT && memcmp(DIR_NAME(dir, slot), key, SHORT_NAME_LEN))
+            slot = dir->chain[slot];
+        return slot;
+    }
+
+    for (size_t i=0; i < dir->used_entries; i++)
+        if (!memcmp(DIR_NAME(dir, i), key, SHORT_NAME_LEN))
+            return i;
 
-    return a[i] - b[i];
+    return NO_SLOT;
 }
 
-int compare_short_name(char* name, char* str) {
-    int i;
-    char short_name_str[12];
+// Drop the scan and its index, lookups walk the directory again
+void dir_arena_forget(dir_t *dir)
+{
+    dir_index_destroy(dir);
+    dir_arena_destroy(dir);
+    dir->probed = 0;
+}
 
-    struct short_name *short_name = (struct short_name *) name;
+void dir_arena_set(dir_t *dir, size_t slot, entry_t *entry, uint32_t offset)
+{
+    memcpy(&dir->entries[slot], entry, sizeof(*entry));
+    dir->offsets[slot] = offset;
+    for (size_t i=0; i < SHORT_NAME_LEN; i++)
+        DIR_NAME(dir, slot)[i] = TOUPPER(entry->short_name[i]);
+}
 
-    for (i = 0; i < 8 && short_name->name[i] != ' '; i++) {
-        short_name_str[i] = short_name->name[i];
+// A deleted slot below the end marker, the next create may take it
+void dir_hole_push(dir_t *dir, uint32_t offset)
+{
+    size_t capacity;
+    uint32_t *holes;
+
+    if (dir->entries == NULL)
+        return;
+
+    if (dir->hole_count == dir->hole_capacity) {
+        capacity = dir->hole_capacity ? 2 * dir->hole_capacity : DIR_ARENA_MIN;
+        holes = realloc(dir->holes, capacity * sizeof(*holes));
+        if (holes == NULL) {
+            puts("Malloc error: not enough space to grow directory holes");
+            dir_arena_forget(dir);
+            return;
+        }
+        dir->holes = holes;
+        dir->hole_capacity = capacity;
     }
+    dir->holes[dir->hole_count++] = offset;
+}
 
-    // Se c'è un'estensione, aggiungila con un '.'
-    if (short_name->ext[0] != ' ') {
-        short_name_str[i++] = '.';
-        int j;
-        for (j = 0; j < 3 && short_name->ext[j] != ' '; j++, i++) {
-            short_name_str[i] = short_name->ext[j];
+// Mirror an on-disk change into the scanned entries and the index
+void dir_entries_update(dir_t *dir, char *short_name, entry_t *entry, uint32_t offset)
+{
+    char key[SHORT_NAME_LEN];
+    size_t last;
+    int slot;
+
+    if (dir->entries == NULL)
+        return;
+
+    if (short_name == NULL) {
+        if (entry->short_name[0] == '\0' || entry->short_name[0] == INVALID_ENTRY)
+            return;
+        if (dir_arena_reserve(dir, dir->used_entries + 1) != 0) {
+            // Forget the scan, lookups fall back to the directory itself
+            puts("Malloc error: not enough space to grow directory entries");
+            dir_arena_forget(dir);
+            return;
+        }
+        slot = dir->used_entries++;
+    } else {
+        for (size_t i=0; i < SHORT_NAME_LEN; i++)
+            key[i] = TOUPPER(short_name[i]);
+        slot = dir_find_slot(dir, key);
+        if (slot == NO_SLOT)
+            return;
+        if (dir->buckets != NULL)
+            dir_index_unlink(dir, slot);
+
+        // Deleted entries leave the arena, the last one takes their place
+        if (entry->short_name[0] == '\0' || entry->short_name[0] == INVALID_ENTRY) {
+            last = --dir->used_entries;
+            if ((size_t) slot == last)
+                return;
+            if (dir->buckets != NULL)
+                dir_index_unlink(dir, last);
+            memcpy(&dir->entries[slot], &dir->entries[last], sizeof(*dir->entries));
+            memcpy(DIR_NAME(dir, slot), DIR_NAME(dir, last), SHORT_NAME_LEN);
+            dir->offsets[slot] = dir->offsets[last];
+            if (dir->buckets != NULL)
+                dir_index_link(dir, slot);
+            return;
         }
     }
 
-    // Aggiungi il terminatore di stringa
-    short_name_str[i] = '\0';
+    dir_arena_set(dir, slot, entry, offset);
+    if (dir->buckets != NULL && dir->used_entries > 2 * dir->bucket_count)
+        dir_index_build(dir);
+    else if (dir->buckets != NULL)
+        dir_index_link(dir, slot);
+}
 
-    // Confronta la stringa temporanea con la stringa passata come argomento
-    return strcmp_insensitive(short_name_str, str);
+void dir_iter_init(dir_iter_t *it, dir_t *dir)
+{
+    it->dir = dir;
+    it->offset = 0;
+    it->lba = 0;
 }
 
-entry_t *dir_search(dir_t *dir, char *name)
+// fs->lock held. Raw slot under the cursor, copied into it->entry
+uint8_t *dir_iter_raw(fat_fs_t *fs, dir_iter_t *it)
 {
-    size_t i = 0;
-    entry_t *ret;
+    size_t sector_size = fs->volume->sector_size;
+    uint32_t cluster;
+
+    if (it->offset >= it->dir->ident->entry->size)
+        return NULL;
 
-    do {
-        if(dir->entries[i] != NULL &&
-            !compare_short_name(dir->entries[i]->short_name, name)) {
-            ret = malloc(sizeof(*ret));
-            memcpy(ret, dir->entries[i], sizeof(*ret));
-            return ret;
+    if (it->lba == 0 || it->offset % sector_size == 0) {
+        cluster = file_get_cluster(it->dir->ident, fs, it->offset);
+        if (cluster == 0)
+            return NULL;
+        it->lba = cluster_to_lba(fs, cluster) + it->offset % fs->volume->cluster_sizeb / sector_size;
+    }
+
+    if (cache_span(fs->cache, fs, it->lba, it->offset % sector_size,
+                   (uint8_t *) &it->entry, sizeof(it->entry), CACHE_READ) != 0)
+        return NULL;
+
+    FS_STAT_ADD(fs, dir_entries_scanned, 1);
+    return (uint8_t *) &it->entry;
+}
+
+// fs->lock held. Next live entry, NULL once the end of directory marker is reached
+entry_t *dir_iter_next_unlocked(fat_fs_t *fs, dir_iter_t *it)
+{
+    uint8_t *raw;
+
+    while ((raw = dir_iter_raw(fs, it)) != NULL) {
+        if (raw[0] == 0) {
+            it->offset = it->dir->ident->entry->size;
+            return NULL;
         }
-    } while(++i < dir->num_entries);
+
+        it->offset += sizeof(entry_t);
+        if (raw[0] != (uint8_t) INVALID_ENTRY && raw[ATTR_OFFSET] != LFN_ATTR)
+            return &it->entry;
+    }
 
     return NULL;
 }
 
-entry_t *dir_search_path(fat_fs_t *fs, dir_t *dir, char *path)
+entry_t *dir_iter_next(fat_fs_t *fs, dir_iter_t *it)
 {
-    char filename[12];
-    dir_t *curr_dir = dir;
-    size_t i = 0;
-    entry_t *entry = NULL;
-    entry_t *ret = NULL;
+    entry_t *entry;
+
+    fat_fs_lock_read(fs);
+    entry = dir_iter_next_unlocked(fs, it);
+    fat_fs_unlock(fs);
+
+    return entry;
+}
+
+// fs->lock held exclusively. Append a zeroed cluster to a full directory
+uint8_t dir_extend(fat_fs_t *fs, dir_t *dir)
+{
+    file_t *ident = dir->ident;
+    uint32_t size = ident->entry->size;
+    uint32_t chain;
+    dir_t *shared;
+
+    if (size + fs->volume->cluster_sizeb > DIR_MAX_SIZE ||
+        file_reserve(ident, fs, size + fs->volume->cluster_sizeb, &chain) != 0)
+        return FS_ERROR;
+
+    ident->entry->size = size + fs->volume->cluster_sizeb;
+    file_zero_fill(ident, fs, size, ident->entry->size);
+    dir->num_entries = ident->entry->size / sizeof(entry_t);
+
+    // The shared dir_t has to walk its chain again to see the new cluster
+    pthread_mutex_lock(&fs->dirs_lock);
+    shared = dir_shared_find(fs, ident->cluster);
+    pthread_mutex_unlock(&fs->dirs_lock);
+    if (shared != NULL && shared != dir) {
+        shared->ident->entry->size = ident->entry->size;
+        shared->num_entries = dir->num_entries;
+        shared->ident->map.complete = 0;
+    }
 
-    // Get filename
-    while (*path != '/' && i < 11 && *path) {
-        filename[i++] = *path++;
+    return 0;
+}
+
+// fs->lock held exclusively. Where to look for a free slot: a hole or the end marker
+// from the scan of the shared dir_t, the start of the directory without one
+uint32_t dir_slot_hint(dir_t *shared)
+{
+    if (shared == NULL || shared->entries == NULL)
+        return 0;
+    if (shared->hole_count > 0)
+        return shared->holes[--shared->hole_count];
+
+    return shared->end;
+}
+
+// fs->lock held exclusively. Takes a free slot, a full directory grows by a cluster
+uint8_t dir_entry_create(fat_fs_t *fs, dir_t *dir, entry_t *entry)
+{
+    dir_t *shared;
+    dir_iter_t it;
+    uint8_t *raw;
+
+    pthread_mutex_lock(&fs->dirs_lock);
+    shared = dir_shared_find(fs, dir->ident->cluster);
+    pthread_mutex_unlock(&fs->dirs_lock);
+
+    // Any free slot will do, a stale hint only makes the walk longer
+    dir_iter_init(&it, dir);
+    it.offset = dir_slot_hint(shared);
+    while ((raw = dir_iter_raw(fs, &it)) != NULL && raw[0] != 0 && raw[0] != (uint8_t) INVALID_ENTRY)
+        it.offset += sizeof(entry_t);
+
+    // A chain shorter than the directory size stops the walk early, only grow at the real end
+    if (raw == NULL && (it.offset < dir->ident->entry->size || dir_extend(fs, dir) != 0))
+        return FS_ERROR;
+
+    if (fs->dcache != NULL)
+        dcache_update(fs->dcache, dir->ident->cluster, NULL, entry);
+    if (file_transfer(dir->ident, fs, NULL, it.offset, (uint8_t *) entry, sizeof(*entry), CACHE_WRITE) != sizeof(*entry))
+        return FS_ERROR;
+
+    // The shared scan stays whole, a private one is only a snapshot
+    if (shared != NULL && shared->entries != NULL) {
+        dir_entries_update(shared, NULL, entry, it.offset);
+        if (it.offset >= shared->end)
+            shared->end = it.offset + sizeof(entry_t);
+    }
+    if (dir != shared)
+        dir_entries_update(dir, NULL, entry, it.offset);
+
+    return 0;
+}
+
+// fs->lock held exclusively
+void dir_entry_override(fat_fs_t *fs, dir_t *dir, char *short_name, entry_t *entry)
+{
+    char key[SHORT_NAME_LEN];
+    entry_t *curr_entry;
+    dir_t *shared;
+    dir_iter_t it;
+    uint32_t offset;
+
+    for (size_t i=0; i < SHORT_NAME_LEN; i++)
+        key[i] = TOUPPER(short_name[i]);
+    curr_entry = dir_locate(fs, dir, key, &it);
+    if (curr_entry == NULL)
+        return;
+    offset = it.offset - sizeof(entry_t);
+
+    if (fs->dcache != NULL)
+        dcache_update(fs->dcache, dir->ident->cluster, curr_entry, entry);
+    // A deleted directory must not be found by its clusters once they are reused
+    if (curr_entry->attr == DIR_ATTR && entry->short_name[0] == INVALID_ENTRY)
+        dir_shared_drop(fs, WORDS_TO_LONG(curr_entry->high_cluster, curr_entry->low_cluster));
+    file_transfer(dir->ident, fs, NULL, offset, (uint8_t *) entry, sizeof(*entry), CACHE_WRITE);
+
+    pthread_mutex_lock(&fs->dirs_lock);
+    shared = dir_shared_find(fs, dir->ident->cluster);
+    pthread_mutex_unlock(&fs->dirs_lock);
+    if (shared != NULL && shared != dir) {
+        dir_entries_update(shared, short_name, entry, offset);
+        if (entry->short_name[0] == INVALID_ENTRY)
+            dir_hole_push(shared, offset);
     }
-    filename[i] = '\0';
+    dir_entries_update(dir, short_name, entry, offset);
+    if (entry->short_name[0] == INVALID_ENTRY)
+        dir_hole_push(dir, offset);
+}
+
+// fs->lock held, and dir->lock for a shared dir_t. A scan cut short by a failed allocation
+// is dropped again. Deleted slots and the end marker are noted for dir_entry_create
+void dir_scan_unlocked(fat_fs_t *fs, dir_t *dir)
+{
+    dir_iter_t it;
+    uint8_t *raw;
+
+    dir_index_destroy(dir);
+    dir->used_entries = 0;
+    dir->hole_count = 0;
+    if (dir_arena_reserve(dir, 1) != 0) {
+        puts("Malloc error: not enough space to allocate directory entries");
+        dir_arena_forget(dir);
+        return;
+    }
+
+    dir_iter_init(&it, dir);
+    while ((raw = dir_iter_raw(fs, &it)) != NULL && raw[0] != 0) {
+        if (raw[0] == (uint8_t) INVALID_ENTRY)
+            dir_hole_push(dir, it.offset);
+        else if (raw[ATTR_OFFSET] != LFN_ATTR) {
+            if (dir_arena_reserve(dir, dir->used_entries + 1) != 0) {
+                puts("Malloc error: not enough space to allocate directory entries");
+                dir_arena_forget(dir);
+                return;
+            }
+            dir_arena_set(dir, dir->used_entries++, &it.entry, it.offset);
+        }
+        if (dir->entries == NULL)
+            return;
+        it.offset += sizeof(entry_t);
+    }
+    dir->end = it.offset;
+
+    dir_index_build(dir);
+}
+
+void dir_scan(fat_fs_t *fs, dir_t *dir)
+{
+    fat_fs_lock_read(fs);
+    pthread_mutex_lock(&dir->lock);
+    dir_scan_unlocked(fs, dir);
+    pthread_mutex_unlock(&dir->lock);
+    fat_fs_unlock(fs);
+}
+
+// fs->lock held. Entry of a scan read back from the directory, NULL if the slot no longer holds key
+entry_t *dir_scan_verify(fat_fs_t *fs, dir_t *dir, dir_iter_t *it, uint32_t offset, char *key)
+{
+    uint8_t *raw;
+
+    dir_iter_init(it, dir);
+    it->offset = offset;
+    raw = dir_iter_raw(fs, it);
+    if (raw == NULL || raw[0] == 0 || raw[0] == (uint8_t) INVALID_ENTRY || raw[ATTR_OFFSET] == LFN_ATTR ||
+        !short_name_equal(it->entry.short_name, key))
+        return NULL;
+
+    return &it->entry;
+}
+
+// fs->lock held. Slot holding key, copied into it->entry with it->offset just past it.
+// A walk stops at the first match. Once walks of a shared dir_t covered DIR_SCAN_AFTER
+// slots it is scanned, and its index answers from then on: hits are read back so sizes
+// and clusters are current. Private dir_t are always walked, their scans may be stale
+entry_t *dir_locate(fat_fs_t *fs, dir_t *dir, char *key, dir_iter_t *it)
+{
+    entry_t *entry = NULL;
+    int slot;
+
+    if (dir->shared) {
+        pthread_mutex_lock(&dir->lock);
+        if (dir->entries == NULL && __atomic_load_n(&dir->probed, __ATOMIC_RELAXED) >= DIR_SCAN_AFTER)
+            dir_scan_unlocked(fs, dir);
+
+        if (dir->entries != NULL) {
+            slot = dir_find_slot(dir, key);
+            if (slot != NO_SLOT)
+                entry = dir_scan_verify(fs, dir, it, dir->offsets[slot], key);
+            // A slot that no longer holds the name means the scan went stale, walk instead
+            if (slot == NO_SLOT || entry != NULL) {
+                pthread_mutex_unlock(&dir->lock);
+                if (entry != NULL)
+                    it->offset += sizeof(entry_t);
+                return entry;
+            }
+            dir_arena_forget(dir);
+        }
+        pthread_mutex_unlock(&dir->lock);
+    }
+
+    dir_iter_init(it, dir);
+    while ((entry = dir_iter_next_unlocked(fs, it)) != NULL)
+        if (short_name_equal(entry->short_name, key))
+            break;
+    __atomic_add_fetch(&dir->probed, it->offset / sizeof(entry_t), __ATOMIC_RELAXED);
 
-    entry = dir_search(curr_dir, filename);
+    return entry;
+}
+
+// fs->lock held
+entry_t *dir_find_unlocked(fat_fs_t *fs, dir_t *dir, char *name)
+{
+    char key[SHORT_NAME_LEN];
+    entry_t *entry;
+    entry_t *ret;
+    dir_iter_t it;
+
+    if (short_name_key(name, key) != 0)
+        return NULL;
+
+    entry = dir_locate(fs, dir, key, &it);
     if (entry == NULL)
         return NULL;
-    
-    if (*path == '/') {
-        curr_dir = dir_init(fs, entry);
-        if (curr_dir == NULL) {
-            free(entry);
-            return NULL;
+
+    ret = malloc(sizeof(*ret));
+    if (ret == NULL)
+        return NULL;
+    memcpy(ret, entry, sizeof(*ret));
+
+    return ret;
+}
+
+entry_t *dir_find(fat_fs_t *fs, dir_t *dir, char *name)
+{
+    entry_t *ret;
+
+    fat_fs_lock_read(fs);
+    ret = dir_find_unlocked(fs, dir, name);
+    fat_fs_unlock(fs);
+
+    return ret;
+}
+
+// Walk an absolute path (without the leading '/') from the root directory
+entry_t *dir_resolve_path(fat_fs_t *fs, char *path, uint32_t *parent)
+{
+    char filename[SHORT_NAME_LEN + 2];
+    dir_t *curr_dir = fat_fs_root(fs);
+    dir_t *next_dir;
+    entry_t *entry = NULL;
+    size_t i;
+
+    if (curr_dir == NULL)
+        return NULL;
+    dir_hold(curr_dir);
+
+    for (;;) {
+        for (i = 0; *path != '/' && *path && i < SHORT_NAME_LEN + 1; i++)
+            filename[i] = *path++;
+        filename[i] = '\0';
+
+        *parent = curr_dir->ident->cluster;
+        if (i == 0 || (*path != '/' && *path != '\0'))
+            break;
+
+        entry = dir_find_unlocked(fs, curr_dir, filename);
+        if (entry == NULL || *path++ == '\0')
+            break;
+
+        // A trailing slash names the directory itself
+        if (entry->attr != DIR_ATTR || *path == '\0' || (next_dir = dir_get(fs, entry)) == NULL) {
+            if (entry->attr != DIR_ATTR || *path != '\0') {
+                free(entry);
+                entry = NULL;
+            }
+            break;
         }
-        
-        // Compie la ricerca
-        dir_scan(fs, curr_dir);
-        ret = dir_search_path(fs, curr_dir, ++path);
-            
+
+        // The entry now belongs to next_dir and goes away with it
+        entry = NULL;
         dir_close(fs, curr_dir);
+        curr_dir = next_dir;
+    }
+
+    dir_close(fs, curr_dir);
+
+    return entry;
+}
+
+// fs->lock held. Absolute path lookup through the path cache, returns a copy of the entry
+entry_t *dir_lookup_path(fat_fs_t *fs, char *path)
+{
+    dir_t *root_dir;
+    entry_t cached;
+    entry_t *entry;
+    uint32_t parent;
+    uint8_t hit;
+
+    if (*path != '/')
+        return NULL;
 
-        if (ret == NULL)
+    if (path[1] == '\0') {
+        if ((root_dir = fat_fs_root(fs)) == NULL)
             return NULL;
-    } else if (*path == '\0') { /* caso base */
+        memcpy(&cached, root_dir->ident->entry, sizeof(cached));
+        hit = DCACHE_HIT;
+    } else if (fs->dcache == NULL || (hit = dcache_lookup(fs->dcache, path, &cached)) == DCACHE_MISS) {
+        entry = dir_resolve_path(fs, path + 1, &parent);
+        if (fs->dcache != NULL)
+            dcache_insert(fs->dcache, path, parent, entry);
         return entry;
-    } else {
-        free(entry);
     }
 
-    return ret;
+    if (hit == DCACHE_NEGATIVE)
+        return NULL;
+
+    entry = malloc(sizeof(*entry));
+    if (entry == NULL) {
+        puts("Malloc error: not enough space to allocate entry");
+        return NULL;
+    }
+    memcpy(entry, &cached, sizeof(*entry));
+
+    return entry;
 }
 
-dir_t *dir_open_path(fat_fs_t *fs, char *path)
+// fs->lock held
+dir_t *dir_open_path_unlocked(fat_fs_t *fs, char *path)
 {
-    dir_t *starting_dir;
     entry_t *entry_dir;
     dir_t *dir;
 
-    if (*path == '/') {
-        starting_dir = fs->root_dir;
-        ++path;
-    }
     // Non supportiamo la path relativa
-    else
+    entry_dir = dir_lookup_path(fs, path);
+    if (entry_dir == NULL)
         return NULL;
-
-    dir_scan(fs, starting_dir);
-    entry_dir = dir_search_path(fs, starting_dir, path);
     if (entry_dir->attr != DIR_ATTR) {
         free(entry_dir);
         return NULL;
     }
 
-    dir = dir_init(fs, entry_dir);
+    dir = dir_get(fs, entry_dir);
     if (dir == NULL) {
         free(entry_dir);
         return NULL;
@@ -276,9 +872,25 @@ dir_t *dir_open_path(fat_fs_t *fs, char *path)
     return dir;
 }
 
+dir_t *dir_open_path(fat_fs_t *fs, char *path)
+{
+    dir_t *dir;
+
+    fat_fs_lock_read(fs);
+    dir = dir_open_path_unlocked(fs, path);
+    fat_fs_unlock(fs);
+
+    return dir;
+}
+
+// Drops a reference, shared directories stay in fs->dirs for the next lookup
 void dir_close(fat_fs_t *fs, dir_t *dir)
 {
-    entry_array_destroy(dir->entries, dir->num_entries);
+    if (__atomic_sub_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+
+    pthread_mutex_destroy(&dir->lock);
+    dir_arena_forget(dir);
     file_close(fs, dir->ident);
     free(dir);
 }
\ No newline at end of file
@@ -0,0 +1,155 @@
+#include <include/fat.h>
+#include <stdlib.h>
+
+#define EXTENT_MAP_INIT_CAP     4
+
+void extent_map_init(extent_map_t *map, uint32_t first_cluster)
+{
+    map->extents = NULL;
+    map->count = 0;
+    map->capacity = 0;
+    map->mapped = 0;
+    map->complete = 0;
+
+    // Empty files have no chain to map
+    if (first_cluster < 2)
+        map->complete = 1;
+    else if (extent_map_append(map, first_cluster) != 0)
+        map->complete = 1;
+}
+
+uint8_t extent_map_append(extent_map_t *map, uint32_t cluster)
+{
+    return extent_map_append_run(map, cluster, 1);
+}
+
+uint8_t extent_map_append_run(extent_map_t *map, uint32_t cluster, uint32_t length)
+{
+    extent_t *last;
+    extent_t *tmp;
+    size_t new_cap;
+
+    if (map->count > 0) {
+        last = &map->extents[map->count - 1];
+        if (last->cluster + last->length == cluster) {
+            last->length += length;
+            map->mapped += length;
+            return 0;
+        }
+    }
+
+    if (map->count == map->capacity) {
+        new_cap = map->capacity ? map->capacity * 2 : EXTENT_MAP_INIT_CAP;
+        tmp = realloc(map->extents, new_cap * sizeof(*tmp));
+        if (tmp == NULL) {
+            puts("Malloc error: not enough space to grow extent map");
+            return FS_ERROR;
+        }
+        map->extents = tmp;
+        map->capacity = new_cap;
+    }
+
+    map->extents[map->count].index = map->mapped;
+    map->extents[map->count].cluster = cluster;
+    map->extents[map->count].length = length;
+    map->count++;
+    map->mapped += length;
+
+    return 0;
+}
+
+// Walk the chain from the last mapped cluster until index is covered
+void extent_map_extend(fat_fs_t *fs, extent_map_t *map, uint32_t index)
+{
+    extent_t *last;
+    uint32_t next;
+
+    while (!map->complete && map->mapped <= index) {
+        last = &map->extents[map->count - 1];
+        next = fat_table_read(fs, last->cluster + last->length - 1) & FAT_ENTRY_MASK;
+        FS_STAT_ADD(fs, chain_steps, 1);
+
+        if (next < 2 || next >= EOC1 || next > fs->volume->cluster_count + 1)
+            map->complete = 1;
+        else if (extent_map_append(map, next) != 0)
+            map->complete = 1;
+    }
+}
+
+size_t extent_map_find(extent_map_t *map, uint32_t index)
+{
+    size_t low = 0;
+    size_t high;
+    size_t mid;
+
+    high = map->count;
+    while (high - low > 1) {
+        mid = (low + high) / 2;
+        if (map->extents[mid].index <= index)
+            low = mid;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+uint32_t extent_map_lookup(fat_fs_t *fs, extent_map_t *map, uint32_t index)
+{
+    size_t i;
+
+    extent_map_extend(fs, map, index);
+    if (index >= map->mapped)
+        return 0;
+
+    i = extent_map_find(map, index);
+    return map->extents[i].cluster + (index - map->extents[i].index);
+}
+
+// On entry *run is the number of clusters wanted, on exit the contiguous clusters available
+uint32_t extent_map_lookup_run(fat_fs_t *fs, extent_map_t *map, uint32_t index, uint32_t *run)
+{
+    extent_t *extent;
+
+    extent_map_extend(fs, map, index + (*run ? *run - 1 : 0));
+    if (index >= map->mapped) {
+        *run = 0;
+        return 0;
+    }
+
+    extent = &map->extents[extent_map_find(map, index)];
+    *run = extent->length - (index - extent->index);
+    return extent->cluster + (index - extent->index);
+}
+
+// As extent_map_lookup_run, but pos receives the whole extent holding index.
+// A sequential reader moves on to the extent after pos->extent, tried before searching
+void extent_map_lookup_pos(fat_fs_t *fs, extent_map_t *map, uint32_t index, uint32_t run, file_pos_t *pos)
+{
+    extent_t *extent;
+    size_t i = pos->extent + 1;
+
+    extent_map_extend(fs, map, index + (run ? run - 1 : 0));
+    if (index >= map->mapped) {
+        pos->length = 0;
+        return;
+    }
+
+    if (i >= map->count || index < map->extents[i].index ||
+        index - map->extents[i].index >= map->extents[i].length)
+        i = extent_map_find(map, index);
+
+    extent = &map->extents[i];
+    pos->extent = i;
+    pos->index = extent->index;
+    pos->cluster = extent->cluster;
+    pos->length = extent->length;
+}
+
+void extent_map_fini(extent_map_t *map)
+{
+    free(map->extents);
+    map->extents = NULL;
+    map->count = 0;
+    map->capacity = 0;
+}
@@ -2,10 +2,16 @@
 #include <stdlib.h>
 #include <string.h>
 
+#define FILE_READAHEAD_SIZE     (32 * 1024)
+#define FILE_IO_WINDOW          16      // Runs of a fragmented transfer in flight at once
+
 file_t *file_open(fat_fs_t *fs, entry_t *entry)
 {
     file_t *file;
 
+    // Data goes through the filesystem block cache and the chain is mapped lazily
+    (void) fs;
+
     file = malloc(sizeof(*file));
     if (file == NULL) {
         puts("Malloc error: not enough space to allocate file");
@@ -14,32 +20,78 @@ file_t *file_open(fat_fs_t *fs, entry_t *entry)
 
     file->path = NULL;
     file->entry = entry;
-    file->cache = cache_init((entry->size / fs->volume->cluster_sizeb) + 1, fs->volume->cluster_sizeb, 
-                              read_cluster, write_cluster);
-    if (file->cache == NULL) {
-        puts("File error: not enough space to init the file cache");
-        free(file);
-        return NULL;
-    }
     file->cluster = WORDS_TO_LONG(entry->high_cluster, entry->low_cluster);
+    extent_map_init(&file->map, file->cluster);
+    file->ra_next = 0;
+    file->ra_end = 0;
+    file->opens = 0;
+    pthread_mutex_init(&file->lock, NULL);
 
     return file;
 }
 
+// Lookups extend the map lazily, threads sharing the file serialize on file->lock
+uint32_t file_get_cluster(file_t *file, fat_fs_t *fs, uint32_t offset)
+{
+    uint32_t cluster;
+
+    pthread_mutex_lock(&file->lock);
+    cluster = extent_map_lookup(fs, &file->map, offset / fs->volume->cluster_sizeb);
+    pthread_mutex_unlock(&file->lock);
+
+    return cluster;
+}
+
+uint32_t file_get_run(file_t *file, fat_fs_t *fs, uint32_t index, uint32_t *run)
+{
+    uint32_t cluster;
+
+    pthread_mutex_lock(&file->lock);
+    cluster = extent_map_lookup_run(fs, &file->map, index, run);
+    pthread_mutex_unlock(&file->lock);
+
+    return cluster;
+}
+
+// Like file_get_run, through a cursor when there is one: while index stays
+// inside the cursor's extent no lock or map lookup is needed
+uint32_t file_pos_run(file_t *file, fat_fs_t *fs, file_pos_t *pos, uint32_t index, uint32_t *run)
+{
+    if (pos == NULL)
+        return file_get_run(file, fs, index, run);
+
+    if (index < pos->index || index - pos->index >= pos->length) {
+        pthread_mutex_lock(&file->lock);
+        extent_map_lookup_pos(fs, &file->map, index, *run, pos);
+        pthread_mutex_unlock(&file->lock);
+        if (pos->length == 0)
+            return 0;
+    }
+
+    *run = pos->length - (index - pos->index);
+    return pos->cluster + (index - pos->index);
+}
+
 uint8_t file_readb(file_t *file, fat_fs_t *fs, uint32_t offset)
 {
     uint32_t cluster;
+    uint8_t data = FAT_EOF;
 
-    if (offset > file->entry->size)
-        return FAT_EOF;
+    fat_fs_lock_read(fs);
+    if (offset <= file->entry->size) {
+        cluster = file_get_cluster(file, fs, offset);
+        if (cluster != 0)
+            data = cache_readb(fs->cache, fs, cluster_to_lba(fs, cluster), offset % fs->volume->cluster_sizeb);
+    }
+    fat_fs_unlock(fs);
 
-    cluster = cluster_chain_read(fs, file->cluster, offset / fs->volume->cluster_sizeb);
-    return cache_readb(file->cache, fs, cluster, offset);
+    return data;
 }
 
 uint8_t *file_read(file_t *file, fat_fs_t *fs, uint32_t offset, size_t size)
 {
     uint8_t *buffer;
+    size_t done;
 
     buffer = malloc(size * sizeof(*buffer));
     if (buffer == NULL) {
@@ -47,46 +99,473 @@ uint8_t *file_read(file_t *file, fat_fs_t *fs, uint32_t offset, size_t size)
         return NULL;
     }
 
-    for (size_t i=0; i < size; i++)
-        buffer[i] = file_readb(file, fs, offset + i);
+    done = file_read_into(file, fs, offset, buffer, size);
+    memset(buffer + done, FAT_EOF, size - done);
 
     return buffer;
 }
 
+// fs->lock held, exclusively if the range was just reserved
+uint8_t file_run_submit(fat_fs_t *fs, uint32_t lba, uint32_t count, uint8_t *buffer, uint8_t mode,
+                        aio_req_t *req, aio_batch_t *batch)
+{
+    if (mode == CACHE_READ)
+        return read_sectors_submit(fs, lba, count, buffer, req, batch);
+
+    return write_sectors_submit(fs, lba, buffer, count, req, batch);
+}
+
+uint8_t file_run_sync(fat_fs_t *fs, uint32_t lba, uint32_t count, uint8_t *buffer, uint8_t mode)
+{
+    if (mode == CACHE_READ)
+        return read_sectors_into(fs, lba, count, buffer);
+
+    write_sectors(fs, lba, buffer, count);
+    return 0;
+}
+
+// Whole-sector writes bypass the cache and only share fs->lock with readers.
+// A reader may load a sector while its write is in flight, so lines of the
+// written runs are dropped again once the writes have completed
+void file_runs_settle(fat_fs_t *fs, uint32_t *lbas, uint32_t *counts, size_t n, uint8_t mode)
+{
+    if (mode != CACHE_WRITE)
+        return;
+
+    for (size_t i=0; i < n; i++)
+        cache_invalidate_range(fs->cache, lbas[i], counts[i]);
+}
+
+size_t file_transfer(file_t *file, fat_fs_t *fs, file_pos_t *pos, uint32_t offset, uint8_t *buffer, size_t size,
+                     uint8_t mode)
+{
+    size_t sector_size = fs->volume->sector_size;
+    size_t cluster_sizeb = fs->volume->cluster_sizeb;
+    aio_req_t reqs[FILE_IO_WINDOW];
+    uint32_t run_lbas[FILE_IO_WINDOW];
+    uint32_t run_counts[FILE_IO_WINDOW];
+    aio_batch_t batch;
+    size_t window_start = 0;
+    size_t queued = 0;
+    uint8_t held = 0;
+    uint32_t held_lba = 0;
+    uint32_t held_count = 0;
+    size_t held_done = 0;
+    uint32_t cluster;
+    uint32_t run;
+    uint32_t lba;
+    uint32_t count;
+    size_t in_cluster;
+    size_t in_sector;
+    size_t done = 0;
+    size_t len;
+    uint8_t status;
+
+    if (offset >= file->entry->size)
+        return 0;
+    if (size > file->entry->size - offset)
+        size = file->entry->size - offset;
+    aio_batch_init(&batch);
+
+    while (done < size) {
+        in_cluster = (offset + done) % cluster_sizeb;
+        run = (in_cluster + size - done + cluster_sizeb - 1) / cluster_sizeb;
+        cluster = file_pos_run(file, fs, pos, (offset + done) / cluster_sizeb, &run);
+        if (cluster == 0)
+            break;
+
+        lba = cluster_to_lba(fs, cluster) + in_cluster / sector_size;
+        in_sector = in_cluster % sector_size;
+
+        // Sectors already read ahead are served from the cache as well
+        if (in_sector != 0 || size - done < sector_size ||
+            (mode == CACHE_READ && cache_contains(fs->cache, lba))) {
+            // Partial sectors go through the block cache
+            len = sector_size - in_sector;
+            if (len > size - done)
+                len = size - done;
+
+            if (cache_span(fs->cache, fs, lba, in_sector, buffer + done, len, mode) != 0)
+                break;
+        } else {
+            // Whole sectors of a contiguous run move in a single device call
+            count = run * fs->volume->cluster_size - in_cluster / sector_size;
+            if (count > (size - done) / sector_size)
+                count = (size - done) / sector_size;
+            len = count * sector_size;
+
+            // Dirty lines must not be written back over the run later
+            if (mode != CACHE_READ)
+                cache_invalidate_range(fs->cache, lba, count);
+            else if (cache_sync_range(fs->cache, fs, lba, count) != 0)
+                break;
+
+            // A run is held back until the next one shows up: earlier runs of a
+            // fragmented file are queued, the last one runs on this thread meanwhile
+            if (held) {
+                if (queued == 0)
+                    window_start = held_done;
+                run_lbas[queued] = held_lba;
+                run_counts[queued] = held_count;
+                if (file_run_submit(fs, held_lba, held_count, buffer + held_done, mode, &reqs[queued++], &batch) != 0) {
+                    held = 0;
+                    done = held_done;
+                    break;
+                }
+            }
+            held = 1;
+            held_lba = lba;
+            held_count = count;
+            held_done = done;
+
+            // On failure nothing past the first run of the window is trusted
+            if (queued == FILE_IO_WINDOW) {
+                queued = 0;
+                status = fat_fs_io_wait(fs, &batch);
+                file_runs_settle(fs, run_lbas, run_counts, FILE_IO_WINDOW, mode);
+                if (status != 0) {
+                    held = 0;
+                    done = window_start;
+                    break;
+                }
+            }
+        }
+
+        done += len;
+    }
+
+    if (held) {
+        if (file_run_sync(fs, held_lba, held_count, buffer + held_done, mode) != 0)
+            done = held_done;
+        file_runs_settle(fs, &held_lba, &held_count, 1, mode);
+    }
+    if (queued > 0) {
+        if (fat_fs_io_wait(fs, &batch) != 0)
+            done = window_start;
+        file_runs_settle(fs, run_lbas, run_counts, queued, mode);
+    }
+
+    return done;
+}
+
+// Prefetch the next FILE_READAHEAD_SIZE bytes from offset, one device read per contiguous run
+void file_readahead(file_t *file, fat_fs_t *fs, uint32_t offset)
+{
+    size_t sector_size = fs->volume->sector_size;
+    size_t cluster_sizeb = fs->volume->cluster_sizeb;
+    uint32_t end;
+    uint32_t cluster;
+    uint32_t run;
+    uint32_t count;
+    size_t in_cluster;
+
+    offset -= offset % sector_size;
+    end = file->entry->size - offset > FILE_READAHEAD_SIZE ? offset + FILE_READAHEAD_SIZE : file->entry->size;
+
+    while (offset < end) {
+        in_cluster = offset % cluster_sizeb;
+        run = (in_cluster + end - offset + cluster_sizeb - 1) / cluster_sizeb;
+        cluster = file_get_run(file, fs, offset / cluster_sizeb, &run);
+        if (cluster == 0)
+            break;
+
+        count = run * fs->volume->cluster_size - in_cluster / sector_size;
+        if (count > (end - offset + sector_size - 1) / sector_size)
+            count = (end - offset + sector_size - 1) / sector_size;
+
+        cache_prefetch(fs->cache, fs, cluster_to_lba(fs, cluster) + in_cluster / sector_size, count);
+        offset += count * sector_size;
+    }
+
+    pthread_mutex_lock(&file->lock);
+    file->ra_end = offset;
+    pthread_mutex_unlock(&file->lock);
+}
+
+size_t file_read_into(file_t *file, fat_fs_t *fs, uint32_t offset, uint8_t *buffer, size_t size)
+{
+    return file_read_at(file, fs, NULL, offset, buffer, size);
+}
+
+size_t file_read_at(file_t *file, fat_fs_t *fs, file_pos_t *pos, uint32_t offset, uint8_t *buffer, size_t size)
+{
+    uint32_t ahead = 0;
+    size_t done;
+
+    fat_fs_lock_read(fs);
+
+    // Small reads continuing the previous one start a readahead window,
+    // refilled once the reader gets into its second half
+    pthread_mutex_lock(&file->lock);
+    if (offset != file->ra_next)
+        file->ra_end = 0;
+    else if (offset != 0 && size < FILE_READAHEAD_SIZE && offset < file->entry->size &&
+             offset + size + FILE_READAHEAD_SIZE / 2 > file->ra_end)
+        ahead = file->ra_end > offset ? file->ra_end : offset;
+    pthread_mutex_unlock(&file->lock);
+
+    if (ahead != 0)
+        file_readahead(file, fs, ahead);
+
+    done = file_transfer(file, fs, pos, offset, buffer, size, CACHE_READ);
+    pthread_mutex_lock(&file->lock);
+    file->ra_next = offset + done;
+    pthread_mutex_unlock(&file->lock);
+
+    fat_fs_unlock(fs);
+
+    return done;
+}
+
+// fs->lock held exclusively. Cut the chain and the extent map back to their first keep clusters
+void file_chain_cut(file_t *file, fat_fs_t *fs, uint32_t keep)
+{
+    extent_map_t *map = &file->map;
+    extent_t *last;
+    uint32_t tail;
+    uint32_t next;
+
+    if (keep >= map->mapped)
+        return;
+
+    if (keep == 0) {
+        cluster_chain_free(fs, file->cluster);
+        file->cluster = 0;
+        file->entry->low_cluster = 0;
+        file->entry->high_cluster = 0;
+        map->count = 0;
+        map->mapped = 0;
+        map->complete = 1;
+        return;
+    }
+
+    while (map->extents[map->count - 1].index >= keep)
+        map->count--;
+    last = &map->extents[map->count - 1];
+    last->length = keep - last->index;
+    map->mapped = keep;
+    map->complete = 1;
+
+    tail = last->cluster + last->length - 1;
+    next = fat_table_read(fs, tail) & FAT_ENTRY_MASK;
+    fat_table_write(fs, tail, EOC1);
+    cluster_chain_free(fs, next);
+}
+
+// fs->lock held exclusively. Make the chain long enough for size bytes, missing clusters are reserved in contiguous runs.
+// chain receives the length the chain had before, capped at what size needs. A failed
+// reservation hands back the runs it already linked
+uint8_t file_reserve(file_t *file, fat_fs_t *fs, uint32_t size, uint32_t *chain)
+{
+    extent_map_t *map = &file->map;
+    extent_t *last;
+    uint32_t need;
+    uint32_t prev = 0;
+    uint32_t first;
+    uint32_t len;
+
+    need = (size + fs->volume->cluster_sizeb - 1) / fs->volume->cluster_sizeb;
+    *chain = need;
+    if (need == 0)
+        return 0;
+
+    extent_map_extend(fs, map, need - 1);
+    if (map->mapped < need)
+        *chain = map->mapped;
+    while (map->mapped < need) {
+        if (map->count > 0) {
+            last = &map->extents[map->count - 1];
+            prev = last->cluster + last->length - 1;
+            // Only link after a real end of chain
+            if ((fat_table_read(fs, prev) & FAT_ENTRY_MASK) < EOC1)
+                break;
+        }
+
+        first = fat_table_alloc_run(fs, prev, need - map->mapped, &len);
+        if (first == CLUSTER_ALLOC_ERR)
+            break;
+
+        if (extent_map_append_run(map, first, len) != 0) {
+            // The run is linked but not mapped, the cut below would miss it
+            cluster_chain_free(fs, first);
+            if (prev != 0)
+                fat_table_write(fs, prev, EOC1);
+            break;
+        }
+        if (prev == 0) {
+            file->cluster = first;
+            file->entry->low_cluster = first & 0xFFFF;
+            file->entry->high_cluster = first >> 16;
+        }
+    }
+
+    if (map->mapped < need) {
+        file_chain_cut(file, fs, *chain);
+        return FS_ERROR;
+    }
+
+    return 0;
+}
+
+void file_zero_fill(file_t *file, fat_fs_t *fs, uint32_t from, uint32_t to)
+{
+    uint8_t *zero;
+    size_t len;
+
+    zero = calloc(1, fs->volume->cluster_sizeb);
+    if (zero == NULL) {
+        puts("Malloc error: not enough space to allocate zero buffer");
+        return;
+    }
+
+    for (; from < to; from += len) {
+        len = to - from < fs->volume->cluster_sizeb ? to - from : fs->volume->cluster_sizeb;
+        file_transfer(file, fs, NULL, from, zero, len, CACHE_WRITE);
+    }
+
+    free(zero);
+}
+
+// fs->lock held exclusively. Store size and first cluster back into the parent directory entry
+uint8_t file_entry_sync(file_t *file, fat_fs_t *fs)
+{
+    dir_t *dir;
+
+    // Files opened without a path (directory idents) have no entry to update
+    if (file->path == NULL)
+        return 0;
+
+    dir = dir_open_path_unlocked(fs, file->path);
+    if (dir == NULL)
+        return FS_ERROR;
+
+    dir_entry_override(fs, dir, file->entry->short_name, file->entry);
+    dir_close(fs, dir);
+
+    return 0;
+}
+
+// Like fallocate: reserve clusters for size bytes, growing the file with zeros unless mode keeps the size
+uint8_t file_allocate(file_t *file, fat_fs_t *fs, uint32_t size, uint8_t mode)
+{
+    uint32_t old_size;
+    uint32_t chain;
+    uint8_t ret = 0;
+
+    fat_fs_lock_write(fs);
+    old_size = file->entry->size;
+    if (file_reserve(file, fs, size, &chain) != 0)
+        ret = FS_ERROR;
+    else if (!(mode & FILE_ALLOC_KEEP_SIZE) && size > old_size) {
+        file->entry->size = size;
+        file_zero_fill(file, fs, old_size, size);
+        ret = file_entry_sync(file, fs);
+    }
+    fat_fs_unlock(fs);
+
+    return ret;
+}
+
+// fs->lock held exclusively. Writes past the end grow the file, the directory entry is updated once
+size_t file_grow_from(file_t *file, fat_fs_t *fs, file_pos_t *pos, uint32_t offset, uint8_t *buffer, size_t size)
+{
+    uint32_t old_size = file->entry->size;
+    uint32_t cluster_sizeb = fs->volume->cluster_sizeb;
+    uint32_t chain;
+    size_t done;
+
+    if ((uint64_t) offset + size > UINT32_MAX || file_reserve(file, fs, offset + size, &chain) != 0)
+        return 0;
+
+    file->entry->size = offset + size;
+    if (offset > old_size)
+        file_zero_fill(file, fs, old_size, offset);
+    done = file_transfer(file, fs, pos, offset, buffer, size, CACHE_WRITE);
+
+    // A short write ends the file at its last byte, clusters reserved past that go back
+    if (done < size) {
+        file->entry->size = offset + done > old_size ? offset + done : old_size;
+        if ((file->entry->size + cluster_sizeb - 1) / cluster_sizeb > chain)
+            chain = (file->entry->size + cluster_sizeb - 1) / cluster_sizeb;
+        file_chain_cut(file, fs, chain);
+        if (pos != NULL)
+            pos->length = 0;
+    }
+    file_entry_sync(file, fs);
+
+    return done;
+}
+
+size_t file_write_from(file_t *file, fat_fs_t *fs, uint32_t offset, uint8_t *buffer, size_t size)
+{
+    return file_write_at(file, fs, NULL, offset, buffer, size);
+}
+
+size_t file_write_at(file_t *file, fat_fs_t *fs, file_pos_t *pos, uint32_t offset, uint8_t *buffer, size_t size)
+{
+    size_t done;
+
+    // Overwrites share the lock, growth needs it exclusively and the size rechecked
+    fat_fs_lock_read(fs);
+    if (size == 0 || (uint64_t) offset + size <= file->entry->size) {
+        done = file_transfer(file, fs, pos, offset, buffer, size, CACHE_WRITE);
+        fat_fs_unlock(fs);
+        return done;
+    }
+    fat_fs_unlock(fs);
+
+    fat_fs_lock_write(fs);
+    if ((uint64_t) offset + size <= file->entry->size)
+        done = file_transfer(file, fs, pos, offset, buffer, size, CACHE_WRITE);
+    else
+        done = file_grow_from(file, fs, pos, offset, buffer, size);
+    fat_fs_unlock(fs);
+
+    return done;
+}
+
+size_t file_append(file_t *file, fat_fs_t *fs, uint8_t *buffer, size_t size)
+{
+    size_t done;
+
+    // The end of file is read under the same lock that moves it
+    fat_fs_lock_write(fs);
+    done = size == 0 ? 0 : file_grow_from(file, fs, NULL, file->entry->size, buffer, size);
+    fat_fs_unlock(fs);
+
+    return done;
+}
+
 void file_writeb(file_t *file, fat_fs_t *fs, uint32_t offset, uint8_t data)
 {
     uint32_t cluster;
 
-    if (offset > file->entry->size)
+    fat_fs_lock_read(fs);
+    if (offset >= file->entry->size) {
+        fat_fs_unlock(fs);
+        file_write_from(file, fs, offset, &data, 1);
         return;
+    }
 
-    cluster = cluster_chain_read(fs, file->cluster, offset / fs->volume->cluster_sizeb);
-    return cache_writeb(file->cache, fs, cluster, offset, data);
+    cluster = file_get_cluster(file, fs, offset);
+    if (cluster != 0)
+        cache_writeb(fs->cache, fs, cluster_to_lba(fs, cluster), offset % fs->volume->cluster_sizeb, data);
+    fat_fs_unlock(fs);
 }
 
 void file_write(file_t *file, fat_fs_t *fs, uint32_t offset, uint8_t *data, size_t size)
 {
-    for (size_t i=0; i < size; i++)
-        file_writeb(file, fs, offset + i, data[i]);
+    file_write_from(file, fs, offset, data, size);
 }
 
-file_t *file_open_path(fat_fs_t *fs, char *path)
+// fs->lock held
+file_t *file_open_path_unlocked(fat_fs_t *fs, char *path)
 {
     entry_t *entry;
-    dir_t *starting_dir;
     char *save_path = path;
     file_t *ret;
 
-    /* root check */
-    if (*path == '/') {
-        starting_dir = fs->root_dir;
-        ++path;
-    }
-    else
-        return NULL;
-
-    dir_scan(fs, starting_dir);
-    entry = dir_search_path(fs, starting_dir, path);
+    entry = dir_lookup_path(fs, path);
     if (entry == NULL)
         return NULL;
     if (entry->attr != FILE_ATTR) {
@@ -95,9 +574,28 @@ file_t *file_open_path(fat_fs_t *fs, char *path)
     }
 
     ret = file_open(fs, entry);
+    if (ret == NULL) {
+        free(entry);
+        return NULL;
+    }
     ret->path = strdup(save_path);
-    if (ret->path != NULL)
-        rstrip_path(ret->path);
+    if (ret->path == NULL) {
+        puts("Malloc error: not enough space to copy file path");
+        file_close(fs, ret);
+        return NULL;
+    }
+    rstrip_path(ret->path);
+
+    return ret;
+}
+
+file_t *file_open_path(fat_fs_t *fs, char *path)
+{
+    file_t *ret;
+
+    fat_fs_lock_read(fs);
+    ret = file_open_path_unlocked(fs, path);
+    fat_fs_unlock(fs);
 
     return ret;
 }
@@ -112,16 +610,13 @@ int ctoupper(char c)
 
 void entry_name_copy(entry_t *entry, char *filename)
 {
-    int j;
-
-    for (int i = 0; i < SHORT_NAME_LEN; i++)
-        entry->short_name[i] = ' ';
-
-    for (j = 0; j < FILENAME_LEN && filename[j] && filename[j] != '.'; j++)
-        entry->short_name[j] = ctoupper(filename[j]);
+    // Names that do not fit 8.3 keep the truncated padded form
+    if (short_name_key(filename, entry->short_name) == 0)
+        return;
 
-    for (int k = 0; k < FILE_EXT_LEN && filename[j]; k++, j++)
-        entry->short_name[SHORT_NAME_LEN + k] = ctoupper(filename[j]);
+    memset(entry->short_name, ' ', SHORT_NAME_LEN);
+    for (int i = 0; i < FILENAME_LEN && filename[i] && filename[i] != '.'; i++)
+        entry->short_name[i] = ctoupper(filename[i]);
 
     return;
 }
@@ -156,68 +651,92 @@ void rstrip_path(char *path)
             return;
         }
 
+    // Files in the root keep "/" as their directory
+    if (path[0] == '/')
+        path[1] = '\0';
+
     return;
 }
 
-void file_create(fat_fs_t *fs, char *path, char *filename)
+// fs->lock held exclusively. FS_ERROR if the name exists or there is no room for it
+uint8_t file_create_unlocked(fat_fs_t *fs, char *path, char *filename)
 {
     uint32_t cluster;
     dir_t *dir;
     entry_t *file_entry;
+    uint8_t ret;
 
-    cluster = first_free_cluster_read(fs);
-    
-    dir = dir_open_path(fs, path);
+    dir = dir_open_path_unlocked(fs, path);
     if (dir == NULL)
-        return;
-    dir_scan(fs, dir);
-    if ((file_entry = dir_search(dir, filename)) != NULL) {
+        return FS_ERROR;
+    if ((file_entry = dir_find_unlocked(fs, dir, filename)) != NULL) {
         free(file_entry);
         dir_close(fs, dir);
-        return;
+        return FS_ERROR;
+    }
+    cluster = fat_table_alloc_cluster(fs, EOC1);
+    if (cluster == CLUSTER_ALLOC_ERR) {
+        dir_close(fs, dir);
+        return FS_ERROR;
     }
     file_entry = file_entry_create(filename, cluster);
     if (file_entry == NULL) {
+        fat_table_write(fs, cluster, 0);
         dir_close(fs, dir);
-        return;
+        return FS_ERROR;
     }
-    
-    fat_table_alloc_cluster(fs, EOC1);
-    dir_entry_create(fs, dir, file_entry);
+
+    ret = dir_entry_create(fs, dir, file_entry);
+    if (ret != 0)
+        fat_table_write(fs, cluster, 0);
 
     dir_close(fs, dir);
     free(file_entry);
 
-    return;
+    return ret;
 }
 
-void file_delete(fat_fs_t *fs, char *path)
+uint8_t file_create(fat_fs_t *fs, char *path, char *filename)
+{
+    uint8_t ret;
+
+    fat_fs_lock_write(fs);
+    ret = file_create_unlocked(fs, path, filename);
+    fat_fs_unlock(fs);
+
+    return ret;
+}
+
+// fs->lock held exclusively
+void file_delete_unlocked(fat_fs_t *fs, char *path)
 {
     dir_t *dir;
     file_t *file;
     entry_t *dummy_entry;
 
-    file = file_open_path(fs, path);
+    file = file_open_path_unlocked(fs, path);
     if (file == NULL)
         return;
     if (file->path == NULL) {
         file_close(fs, file);
         return;
     }
-    dir = dir_open_path(fs, file->path);
+    dir = dir_open_path_unlocked(fs, file->path);
     if (dir == NULL) {
         file_close(fs, file);
         return;
     }
-    dummy_entry = calloc(1, sizeof(*dummy_entry));
+    dummy_entry = malloc(sizeof(*dummy_entry));
     if (dummy_entry == NULL) {
         dir_close(fs, dir);
         file_close(fs, file);
         return;
     }
-    dir_scan(fs, dir);
+    // Mark the slot deleted, a zeroed one would end the directory early
+    memcpy(dummy_entry, file->entry, sizeof(*dummy_entry));
+    dummy_entry->short_name[0] = INVALID_ENTRY;
     dir_entry_override(fs, dir, file->entry->short_name, dummy_entry);
-    fat_table_write(fs, file->cluster, 0);
+    cluster_chain_free(fs, file->cluster);
 
     file_close(fs, file);
     dir_close(fs, dir);
@@ -226,12 +745,22 @@ void file_delete(fat_fs_t *fs, char *path)
     return;
 }
 
+void file_delete(fat_fs_t *fs, char *path)
+{
+    fat_fs_lock_write(fs);
+    file_delete_unlocked(fs, path);
+    fat_fs_unlock(fs);
+}
+
 void file_close(fat_fs_t *fs, file_t *file) 
 {
+    // Dirty blocks stay in the shared cache until eviction or unmount
+    (void) fs;
+
     if (file->path != NULL)
         free(file->path);
-    cache_flush(file->cache, fs);
-    cache_fini(file->cache);
+    extent_map_fini(&file->map);
+    pthread_mutex_destroy(&file->lock);
     free(file->entry);
     free(file);
 }
\ No newline at end of file
@@ -1,8 +1,16 @@
 #include <include/fat.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-fat_volume_t *fat_volume_init(FILE *drive)
+#define FS_CACHE_SIZE       256
+#define FS_DCACHE_SIZE      4096
+#define FS_DCACHE_MIN       64      // A smaller path cache is not worth its lock
+#define FS_DCACHE_SHARE     8       // The path cache gets 1/8 of a memory budget
+#define FS_AIO_DEPTH        32
+#define FS_AIO_MIN_SIZE     (32 * 1024)
+
+fat_volume_t *fat_volume_init(blkdev_t *dev)
 {
     fat_volume_t *volume;
 
@@ -11,7 +19,8 @@ fat_volume_t *fat_volume_init(FILE *drive)
         puts("Malloc error: not enough space to allocate volume struct");
         return NULL;
     }
-    volume->drive = drive;
+    volume->dev = dev;
+    volume->owns_dev = 0;
     volume->label = malloc(sizeof(char) * LABEL_LENGTH);
     if (volume->label == NULL) {
         puts("Malloc error: not enough space to allocate volume label");
@@ -26,6 +35,8 @@ fat_volume_t *fat_volume_init(FILE *drive)
 
 void fat_volume_fini(fat_volume_t *volume)
 {
+    if (volume->owns_dev)
+        blkdev_close(volume->dev);
     free(volume->label);
     free(volume);
 
@@ -50,6 +61,7 @@ void fat_table_getinfo(fat_table_t *fat_table, uint8_t *info_buffer)
     fat_table->address = BYTES_TO_WORD(info_buffer, RESERVED_SECTORS);
     fat_table->size = BYTES_TO_LONG(info_buffer, FAT_TABLE_SIZE);
     fat_table->count = info_buffer[FAT_TABLE_COUNT];
+    fat_table->mirror = fat_table->count > 1 && !(info_buffer[EXT_FLAGS] & NO_FAT_MIRROR);
 }
 
 void fat_volume_get_clusters(fat_volume_t *volume, fat_table_t *table)
@@ -85,11 +97,7 @@ uint8_t fat_fs_getinfo(fat_fs_t *fs)
 
     fs->info.root_cluster = BYTES_TO_LONG(info_buffer, ROOT_CLUSTER);
     fs->info.free_cluster_count = BYTES_TO_LONG(fs->info.buffer , FREE_CLUSTER_COUNT);
-    if (fs->info.free_cluster_count == UNKNOWN_FREE_CLUSTER)
-        fs->info.free_cluster_count = free_cluster_count_read(fs);
     fs->info.free_cluster = BYTES_TO_LONG(fs->info.buffer , FREE_CLUSTER);
-    if (fs->info.free_cluster == UNKNOWN_FREE_CLUSTER)
-        fs->info.free_cluster = first_free_cluster_read(fs);
     fs->info.data_region = (fs->table->size * fs->table->count) + fs->table->address;
 
 exit:
@@ -98,14 +106,28 @@ exit:
     return err;
 }
 
-void fat_fsinfo_flush(fat_fs_t *fs)
+// Written back only when a hint changed since it was read or last flushed
+// The buffer mirrors the sector on disk, a failed write leaves it as it was
+uint8_t fat_fsinfo_flush(fat_fs_t *fs)
 {
+    uint32_t count = BYTES_TO_LONG(fs->info.buffer, FREE_CLUSTER_COUNT);
+    uint32_t next = BYTES_TO_LONG(fs->info.buffer, FREE_CLUSTER);
+
+    if (count == fs->info.free_cluster_count && next == fs->info.free_cluster)
+        return 0;
+
     memcpy(fs->info.buffer + FREE_CLUSTER_COUNT, 
           &fs->info.free_cluster_count, sizeof(fs->info.free_cluster_count));
     memcpy(fs->info.buffer + FREE_CLUSTER, 
           &fs->info.free_cluster, sizeof(fs->info.free_cluster));
 
-    write_sector(fs, fs->info.sector, fs->info.buffer);
+    if (write_sector(fs, fs->info.sector, fs->info.buffer) != 0) {
+        memcpy(fs->info.buffer + FREE_CLUSTER_COUNT, &count, sizeof(count));
+        memcpy(fs->info.buffer + FREE_CLUSTER, &next, sizeof(next));
+        return FS_ERROR;
+    }
+
+    return 0;
 }
 
 entry_t *fake_entry_create(uint32_t cluster, char *name, size_t size)
@@ -119,17 +141,124 @@ entry_t *fake_entry_create(uint32_t cluster, char *name, size_t size)
     }
 
     strncpy(fake_entry->short_name, name, SHORT_NAME_LEN);
-    fake_entry->low_cluster = cluster & 0xFF;
+    fake_entry->low_cluster = cluster & 0xFFFF;
     fake_entry->high_cluster = cluster >> 16;
     fake_entry->size = size;
+    fake_entry->attr = DIR_ATTR;
 
     return fake_entry;
 }
 
 fat_fs_t *fat_fs_init(FILE *partition)
 {
+    blkdev_t *dev;
     fat_fs_t *fs;
+
+    if (partition == NULL)
+        return NULL;
+
+    // Stdio is only used to hand over the descriptor, all I/O is positional
+    fflush(partition);
+    dev = blkdev_fd_open(fileno(partition));
+    if (dev == NULL)
+        return NULL;
+
+    fs = fat_fs_mount(dev);
+    if (fs == NULL) {
+        blkdev_close(dev);
+        return NULL;
+    }
+    fs->volume->owns_dev = 1;
+
+    return fs;
+}
+
+// Nanoseconds since *mark, which then moves to now
+uint64_t fs_clock_lap(uint64_t *mark)
+{
+    struct timespec ts;
+    uint64_t now;
+    uint64_t elapsed;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    elapsed = now - *mark;
+    *mark = now;
+
+    return elapsed;
+}
+
+// Drop FSInfo hints that cannot be right for this volume
+void fat_fsinfo_check(fat_fs_t *fs)
+{
+    if (fs->info.free_cluster_count > fs->volume->cluster_count)
+        fs->info.free_cluster_count = UNKNOWN_FREE_CLUSTER;
+    if (fs->info.free_cluster < 2 || fs->info.free_cluster >= fs->volume->cluster_count + 2)
+        fs->info.free_cluster = UNKNOWN_FREE_CLUSTER;
+}
+
+dir_t *fat_fs_open_root(fat_fs_t *fs)
+{
     entry_t *root_entry;
+    dir_t *root;
+
+    // dir_init sizes directories from their chain
+    root_entry = fake_entry_create(fs->info.root_cluster, "/", 0);
+    if (root_entry == NULL)
+        return NULL;
+
+    root = dir_init(fs, root_entry);
+    if (root == NULL) {
+        free(root_entry);
+        return NULL;
+    }
+    root->shared = 1;
+
+    return root;
+}
+
+// Root directory, opened here on first use when the mount deferred it
+dir_t *fat_fs_root(fat_fs_t *fs)
+{
+    dir_t *root = __atomic_load_n(&fs->root_dir, __ATOMIC_ACQUIRE);
+    dir_t *expected = NULL;
+
+    if (root != NULL)
+        return root;
+
+    // Lookups only hold fs->lock shared, the loser of a race drops its copy
+    root = fat_fs_open_root(fs);
+    if (root != NULL &&
+        !__atomic_compare_exchange_n(&fs->root_dir, &expected, root, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        dir_close(fs, root);
+        root = expected;
+    }
+
+    return root;
+}
+
+fat_fs_t *fat_fs_mount(blkdev_t *dev)
+{
+    return fat_fs_mount_flags(dev, 0);
+}
+
+fat_fs_t *fat_fs_mount_flags(blkdev_t *dev, uint32_t flags)
+{
+    return fat_fs_mount_mem(dev, flags, 0);
+}
+
+// mem_limit bounds the cached data, block cache and path cache together, in bytes.
+// 0 keeps the default sizes. Nothing is sized from the files that get opened
+fat_fs_t *fat_fs_mount_mem(blkdev_t *dev, uint32_t flags, size_t mem_limit)
+{
+    size_t cache_lines = FS_CACHE_SIZE;
+    size_t dcache_entries = FS_DCACHE_SIZE;
+    fat_fs_t *fs;
+    uint64_t start = 0;
+    uint64_t mark = 0;
+
+    fs_clock_lap(&start);
+    mark = start;
 
     fs = calloc(1, sizeof(*fs));
     if (fs == NULL) {
@@ -137,49 +266,187 @@ fat_fs_t *fat_fs_init(FILE *partition)
         return NULL;
     }
 
-    fs->volume = fat_volume_init(partition);
+    fs->volume = fat_volume_init(dev);
     if (fs->volume == NULL) {
         free(fs);
         return NULL;
     }
     
-    fs->table = fat_table_init(fs->volume);
+    fs->table = fat_table_init();
     if (fs->table == NULL) {
         fat_volume_fini(fs->volume);
         free(fs);
         return NULL;
     }
+    fs->lock = aligned_alloc(_Alignof(fs_lock_t), sizeof(*fs->lock) * FS_LOCK_SLOTS);
+    if (fs->lock == NULL) {
+        puts("Malloc error: not enough space to allocate filesystem lock");
+        fat_table_fini(fs->table);
+        fat_volume_fini(fs->volume);
+        free(fs);
+        return NULL;
+    }
+    for (int i=0; i < FS_LOCK_SLOTS; i++)
+        pthread_rwlock_init(&fs->lock[i].lock, NULL);
+    pthread_mutex_init(&fs->handle_lock, NULL);
+    pthread_mutex_init(&fs->dirs_lock, NULL);
 
     if (fat_fs_getinfo(fs) == FS_ERROR) {
         puts("Fsinfo error: filesystem info structure is corrupted");
         fat_fs_fini(fs);
         return NULL;
     }
-
-    root_entry = fake_entry_create(fs->info.root_cluster, "/", fs->volume->sector_count * fs->volume->sector_size);
-    if (root_entry != NULL) {
-        fs->root_dir = dir_init(fs, root_entry);
+    fat_fsinfo_check(fs);
+    fs->mount_times.superblock = fs_clock_lap(&mark);
+
+    // Block size is only known once the BPB has been parsed
+    // Without the dirty sector list every mirror pass copies the whole FAT
+    if (fs->table->mirror)
+        fat_table_mirror_init(fs->table);
+
+    // Lookups still work uncached if the path cache cannot be allocated.
+    // Under a budget the block cache gets whatever the path cache leaves
+    if (mem_limit != 0) {
+        dcache_entries = dcache_entries_for(mem_limit / FS_DCACHE_SHARE);
+        if (dcache_entries > FS_DCACHE_SIZE)
+            dcache_entries = FS_DCACHE_SIZE;
     }
+    if (dcache_entries >= FS_DCACHE_MIN)
+        fs->dcache = dcache_init(dcache_entries);
+    if (mem_limit != 0)
+        cache_lines = cache_lines_for(mem_limit - (fs->dcache != NULL ? dcache_mem_size(fs->dcache) : 0),
+                                      fs->volume->sector_size);
+    fs->mem_limit = mem_limit;
+
+    fs->cache = cache_init(cache_lines, fs->volume->sector_size, read_sector_cached, write_sectors_vec);
+    if (fs->cache == NULL) {
+        fat_fs_fini(fs);
+        return NULL;
+    }
+
+    // Without the queue every submission completes synchronously
+    fs->aio = aio_init(dev, FS_AIO_DEPTH, 0);
+    fs->mount_times.caches = fs_clock_lap(&mark);
+
+    // Valid FSInfo hints stand in for the bitmap until the first allocation, or for good
+    if (flags & FS_MOUNT_LAZY_BITMAP)
+        fs->table->lazy = 1;
+    else if (!(flags & FS_MOUNT_TRUST_FSINFO) ||
+             fs->info.free_cluster_count == UNKNOWN_FREE_CLUSTER || fs->info.free_cluster == UNKNOWN_FREE_CLUSTER)
+        fat_table_bitmap_load(fs);
+    fs->mount_times.free_space = fs_clock_lap(&mark);
+
+    if (!(flags & FS_MOUNT_LAZY_ROOT))
+        fs->root_dir = fat_fs_open_root(fs);
+    fs->mount_times.root = fs_clock_lap(&mark);
+    fs->mount_times.total = mark - start;
 
     return fs;
 }
 
+// Bytes held by the block cache, the path cache and the directory scans
+size_t fat_fs_mem_usage(fat_fs_t *fs)
+{
+    size_t size = 0;
+
+    if (fs->cache != NULL)
+        size += cache_mem_size(fs->cache);
+    if (fs->dcache != NULL)
+        size += dcache_mem_size(fs->dcache);
+    size += dir_mem_size(fs);
+
+    return size;
+}
+
+void fat_fs_stats(fat_fs_t *fs, fat_stats_t *stats)
+{
+    memcpy(stats, &fs->stats, sizeof(*stats));
+}
+
+void fat_fs_stats_reset(fat_fs_t *fs)
+{
+    memset(&fs->stats, 0, sizeof(fs->stats));
+}
+
+// Threads get reader slots round robin, the first time they lock any filesystem
+static int fs_lock_next;
+static __thread int fs_lock_slot = -1;
+// Filesystem this thread holds exclusively, so fat_fs_unlock knows what to release
+static __thread fat_fs_t *fs_lock_owner;
+
+void fat_fs_lock_read(fat_fs_t *fs)
+{
+    if (fs_lock_slot < 0)
+        fs_lock_slot = __atomic_fetch_add(&fs_lock_next, 1, __ATOMIC_RELAXED) % FS_LOCK_SLOTS;
+    pthread_rwlock_rdlock(&fs->lock[fs_lock_slot].lock);
+}
+
+// Slots are taken in order, two writers cannot deadlock on each other
+void fat_fs_lock_write(fat_fs_t *fs)
+{
+    for (int i=0; i < FS_LOCK_SLOTS; i++)
+        pthread_rwlock_wrlock(&fs->lock[i].lock);
+    fs_lock_owner = fs;
+}
+
+void fat_fs_unlock(fat_fs_t *fs)
+{
+    if (fs_lock_owner != fs) {
+        pthread_rwlock_unlock(&fs->lock[fs_lock_slot].lock);
+        return;
+    }
+    fs_lock_owner = NULL;
+    for (int i=FS_LOCK_SLOTS - 1; i >= 0; i--)
+        pthread_rwlock_unlock(&fs->lock[i].lock);
+}
+
+// Checkpoint: FSInfo, the FAT copies and every dirty block reach the device,
+// FS_ERROR when some block could not be written and is still dirty
+uint8_t fat_fs_flush(fat_fs_t *fs)
+{
+    uint8_t status = 0;
+
+    fat_fs_lock_write(fs);
+    if (fs->info.buffer != NULL)
+        status = fat_fsinfo_flush(fs);
+
+    if (fs->cache != NULL) {
+        fat_table_mirror(fs);
+        if (cache_flush(fs->cache, fs) != 0)
+            status = FS_ERROR;
+    }
+    fat_fs_unlock(fs);
+
+    return status;
+}
+
 void fat_fs_fini(fat_fs_t *fs)
 {
+    fat_handle_fini(fs);
+    dir_shared_fini(fs);
     if (fs->root_dir != NULL)
         dir_close(fs, fs->root_dir);
-    
-    if (fs->info.buffer != NULL) {
-        fat_fsinfo_flush(fs);
+    if (fs->dcache != NULL)
+        dcache_fini(fs->dcache);
+
+    fat_fs_flush(fs);
+    if (fs->info.buffer != NULL)
         free(fs->info.buffer);
-    }
-    
-    fat_table_fini(fs->table, fs);
+    if (fs->cache != NULL)
+        cache_fini(fs->cache);
+    if (fs->aio != NULL)
+        aio_fini(fs->aio);
+
+    fat_table_fini(fs->table);
     fat_volume_fini(fs->volume);
+    for (int i=0; i < FS_LOCK_SLOTS; i++)
+        pthread_rwlock_destroy(&fs->lock[i].lock);
+    free(fs->lock);
+    pthread_mutex_destroy(&fs->handle_lock);
+    pthread_mutex_destroy(&fs->dirs_lock);
     free(fs);
 }
 
-
 uint8_t *read_sector(fat_fs_t *fs, uint32_t lba)
 {
     uint8_t *buffer;
@@ -195,46 +462,76 @@ uint8_t *read_sector(fat_fs_t *fs, uint32_t lba)
         puts("Malloc error: not enough space to allocate disk buffer");
         return NULL;
     }
-    
-    fseek(volume->drive, lba * volume->sector_size, SEEK_SET);
-    fread(buffer, sizeof(*buffer), volume->sector_size, volume->drive);
+
+    FS_STAT_ADD(fs, device_reads, 1);
+    FS_STAT_ADD(fs, sectors_read, 1);
+    if (volume->dev->ops->read(volume->dev, (uint64_t) lba * volume->sector_size, buffer, volume->sector_size) != 0) {
+        free(buffer);
+        return NULL;
+    }
 
     return buffer;
 }
 
-uint8_t *read_sectors(fat_fs_t *fs, uint32_t lba, uint32_t n)
+uint8_t read_sectors_into(fat_fs_t *fs, uint32_t lba, uint32_t n, uint8_t *buffer)
 {
-    uint8_t *buffer;
     fat_volume_t *volume = fs->volume;
 
     if (lba + n - 1 > volume->sector_count) {
         puts("Disk error: tried reading off the bounds.");
-        return NULL;
+        return FS_ERROR;
     }
 
-    buffer = malloc(sizeof(uint8_t) * volume->sector_size * n);
+    FS_STAT_ADD(fs, device_reads, 1);
+    FS_STAT_ADD(fs, sectors_read, n);
+    return volume->dev->ops->read(volume->dev, (uint64_t) lba * volume->sector_size, buffer, volume->sector_size * n);
+}
+
+// Cache fill: point into the device when it is mapped, otherwise read into buffer
+uint8_t *read_sector_cached(fat_fs_t *fs, uint32_t lba, uint8_t *buffer)
+{
+    uint8_t *mapped;
+
+    mapped = map_sectors(fs, lba, 1);
+    if (mapped != NULL)
+        return mapped;
+
+    if (read_sectors_into(fs, lba, 1, buffer) != 0)
+        return NULL;
+
+    return buffer;
+}
+
+uint8_t *read_sectors(fat_fs_t *fs, uint32_t lba, uint32_t n)
+{
+    uint8_t *buffer;
+
+    buffer = malloc(sizeof(uint8_t) * fs->volume->sector_size * n);
     if (buffer == NULL) {
         puts("Malloc error: not enough space to allocate disk buffer");
         return NULL;
     }
-    
-    fseek(volume->drive, lba * volume->sector_size, SEEK_SET);
-    fread(buffer, sizeof(*buffer), volume->sector_size * n, volume->drive);
+
+    if (read_sectors_into(fs, lba, n, buffer) != 0) {
+        free(buffer);
+        return NULL;
+    }
 
     return buffer;
 }
 
-void write_sector(fat_fs_t *fs, uint32_t lba, uint8_t *buffer)
+uint8_t write_sector(fat_fs_t *fs, uint32_t lba, uint8_t *buffer)
 {
     fat_volume_t *volume = fs->volume;
 
     if (lba > volume->sector_count) {
         puts("Disk error: tried writing off the bounds.");
-        return;
+        return FS_ERROR;
     }
 
-    fseek(volume->drive, lba * volume->sector_size, SEEK_SET);
-    fwrite(buffer, sizeof(*buffer), volume->sector_size, volume->drive);
+    FS_STAT_ADD(fs, device_writes, 1);
+    FS_STAT_ADD(fs, sectors_written, 1);
+    return volume->dev->ops->write(volume->dev, (uint64_t) lba * volume->sector_size, buffer, volume->sector_size);
 }
 
 void write_sectors(fat_fs_t *fs, uint32_t lba, uint8_t *buffer, uint32_t n)
@@ -246,39 +543,158 @@ void write_sectors(fat_fs_t *fs, uint32_t lba, uint8_t *buffer, uint32_t n)
         return;
     }
 
-    fseek(volume->drive, lba * volume->sector_size, SEEK_SET);
-    fwrite(buffer, sizeof(*buffer), volume->sector_size * n, volume->drive);
+    FS_STAT_ADD(fs, device_writes, 1);
+    FS_STAT_ADD(fs, sectors_written, n);
+    volume->dev->ops->write(volume->dev, (uint64_t) lba * volume->sector_size, buffer, volume->sector_size * n);
 }
 
-uint8_t *read_cluster(fat_fs_t *fs, uint32_t cluster)
+// n sectors starting at lba, gathered from one vector per sector
+uint8_t write_sectors_vec(fat_fs_t *fs, uint32_t lba, struct iovec *iov, int n)
 {
-    uint32_t offset;
-    uint8_t *buffer;
+    fat_volume_t *volume = fs->volume;
+
+    if (lba + n - 1 > volume->sector_count) {
+        puts("Disk error: tried writing off the bounds.");
+        return FS_ERROR;
+    }
 
+    FS_STAT_ADD(fs, device_writes, 1);
+    FS_STAT_ADD(fs, sectors_written, n);
+    return volume->dev->ops->writev(volume->dev, (uint64_t) lba * volume->sector_size, iov, n);
+}
+
+// Queue a device request through the I/O engine, or run it right away without one
+uint8_t sectors_submit(fat_fs_t *fs, uint8_t op, uint32_t lba, struct iovec *iov, int n, aio_req_t *req, aio_batch_t *batch)
+{
+    fat_volume_t *volume = fs->volume;
+    size_t size = 0;
+    uint8_t status;
+
+    req->op = op;
+    req->offset = (uint64_t) lba * volume->sector_size;
+    req->iov = iov;
+    req->iov_count = n;
+    req->batch = batch;
+    req->done = NULL;
+    for (int i=0; i < n; i++)
+        size += iov[i].iov_len;
+
+    // Handing a small request over costs more than it can overlap
+    if (fs->aio != NULL && size >= FS_AIO_MIN_SIZE)
+        return aio_submit(fs->aio, req);
+
+    if (op == AIO_WRITE)
+        status = volume->dev->ops->writev(volume->dev, req->offset, iov, n);
+    else
+        status = volume->dev->ops->read(volume->dev, req->offset, iov->iov_base, iov->iov_len);
+    if (status != 0 && fs->aio != NULL)
+        aio_batch_fail(fs->aio, batch);
+    else if (status != 0)
+        batch->status = FS_ERROR;
+
+    return 0;
+}
+
+uint8_t read_sectors_submit(fat_fs_t *fs, uint32_t lba, uint32_t n, uint8_t *buffer, aio_req_t *req, aio_batch_t *batch)
+{
+    if (lba + n - 1 > fs->volume->sector_count) {
+        puts("Disk error: tried reading off the bounds.");
+        return FS_ERROR;
+    }
+
+    FS_STAT_ADD(fs, device_reads, 1);
+    FS_STAT_ADD(fs, sectors_read, n);
+    req->vec.iov_base = buffer;
+    req->vec.iov_len = n * fs->volume->sector_size;
+    return sectors_submit(fs, AIO_READ, lba, &req->vec, 1, req, batch);
+}
+
+uint8_t write_sectors_submit(fat_fs_t *fs, uint32_t lba, uint8_t *buffer, uint32_t n, aio_req_t *req, aio_batch_t *batch)
+{
+    req->vec.iov_base = buffer;
+    req->vec.iov_len = n * fs->volume->sector_size;
+    return write_sectors_vec_submit(fs, lba, &req->vec, 1, req, batch);
+}
+
+// iov must cover exactly n sectors and outlive the request
+uint8_t write_sectors_vec_submit(fat_fs_t *fs, uint32_t lba, struct iovec *iov, int n, aio_req_t *req, aio_batch_t *batch)
+{
+    size_t sectors = 0;
+
+    for (int i=0; i < n; i++)
+        sectors += iov[i].iov_len / fs->volume->sector_size;
+    if (lba + sectors - 1 > fs->volume->sector_count) {
+        puts("Disk error: tried writing off the bounds.");
+        return FS_ERROR;
+    }
+
+    FS_STAT_ADD(fs, device_writes, 1);
+    FS_STAT_ADD(fs, sectors_written, sectors);
+    return sectors_submit(fs, AIO_WRITE, lba, iov, n, req, batch);
+}
+
+uint8_t fat_fs_io_wait(fat_fs_t *fs, aio_batch_t *batch)
+{
+    uint8_t status;
+
+    if (fs->aio != NULL)
+        return aio_wait(fs->aio, batch);
+
+    status = batch->status;
+    batch->status = 0;
+    return status;
+}
+
+// Pointer straight into the device memory, NULL when the backend cannot map
+uint8_t *map_sectors(fat_fs_t *fs, uint32_t lba, uint32_t n)
+{
+    fat_volume_t *volume = fs->volume;
+
+    if (volume->dev->ops->map == NULL || lba + n - 1 > volume->sector_count)
+        return NULL;
+
+    return volume->dev->ops->map(volume->dev, (uint64_t) lba * volume->sector_size, volume->sector_size * n);
+}
+
+uint32_t cluster_to_lba(fat_fs_t *fs, uint32_t cluster)
+{
+    return fs->info.data_region + (cluster - 2) * fs->volume->cluster_size;
+}
+
+uint8_t read_cluster_into(fat_fs_t *fs, uint32_t cluster, uint8_t *buffer)
+{
     if (cluster > fs->volume->cluster_count) {
         puts("Disk error: reading cluster off the bounds");
-        return NULL;
+        return FS_ERROR;
     }
 
-    offset = cluster * fs->volume->cluster_size;
+    return read_sectors_into(fs, cluster_to_lba(fs, cluster), fs->volume->cluster_size, buffer);
+}
 
-    buffer = read_sectors(fs, fs->info.data_region + offset - 2, fs->volume->cluster_size);
-    if (buffer == NULL)
+uint8_t *read_cluster(fat_fs_t *fs, uint32_t cluster)
+{
+    uint8_t *buffer;
+
+    buffer = malloc(fs->volume->cluster_sizeb);
+    if (buffer == NULL) {
+        puts("Malloc error: not enough space to allocate disk buffer");
         return NULL;
-    
+    }
+
+    if (read_cluster_into(fs, cluster, buffer) != 0) {
+        free(buffer);
+        return NULL;
+    }
+
     return buffer;
 }
 
 void write_cluster(fat_fs_t *fs, uint32_t cluster, uint8_t *buffer)
 {
-    uint32_t offset;
-
     if (cluster > fs->volume->cluster_count) {
         puts("Disk error: reading cluster off the bounds");
         return;
     }
 
-    offset = cluster * fs->volume->cluster_size;
-    
-    write_sectors(fs, fs->info.data_region + offset - 2, buffer, fs->volume->cluster_size);
+    write_sectors(fs, cluster_to_lba(fs, cluster), buffer, fs->volume->cluster_size);
 }
@@ -0,0 +1,329 @@
+#include <include/fat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define HANDLE_INIT_CAP     16
+
+// fs->handle_lock held. Lowest free descriptor as with POSIX open, -1 if the table cannot grow
+int fat_handle_slot(fat_fs_t *fs)
+{
+    fat_handle_t **tmp;
+    int new_count;
+    int fd;
+
+    for (fd=0; fd < fs->handle_count; fd++)
+        if (fs->handles[fd] == NULL)
+            return fd;
+
+    new_count = fs->handle_count ? fs->handle_count * 2 : HANDLE_INIT_CAP;
+    tmp = realloc(fs->handles, new_count * sizeof(*tmp));
+    if (tmp == NULL) {
+        puts("Malloc error: not enough space to grow descriptor table");
+        return -1;
+    }
+    memset(tmp + fs->handle_count, 0, (new_count - fs->handle_count) * sizeof(*tmp));
+    fs->handles = tmp;
+    fs->handle_count = new_count;
+
+    return fd;
+}
+
+// Same directory entry: same parent and name, and the same chain so that a file deleted
+// while open is not taken for a new one of that name
+uint8_t fat_handle_same_file(file_t *a, file_t *b)
+{
+    return a->cluster == b->cluster && a->path != NULL && b->path != NULL &&
+           !strcasecmp(a->path, b->path) &&
+           !memcmp(a->entry->short_name, b->entry->short_name, SHORT_NAME_LEN);
+}
+
+// fs->handle_lock held. Open file of the entry file was opened on, file itself if there is
+// none yet. Descriptors then see one size and chain, NULL if the list cannot grow
+file_t *fat_handle_file(fat_fs_t *fs, file_t *file)
+{
+    file_t **tmp;
+    int new_capacity;
+
+    for (int i=0; i < fs->file_count; i++)
+        if (fat_handle_same_file(fs->files[i], file))
+            return fs->files[i];
+
+    if (fs->file_count == fs->file_capacity) {
+        new_capacity = fs->file_capacity ? fs->file_capacity * 2 : HANDLE_INIT_CAP;
+        tmp = realloc(fs->files, new_capacity * sizeof(*tmp));
+        if (tmp == NULL) {
+            puts("Malloc error: not enough space to grow open file list");
+            return NULL;
+        }
+        fs->files = tmp;
+        fs->file_capacity = new_capacity;
+    }
+    fs->files[fs->file_count++] = file;
+
+    return file;
+}
+
+// fs->handle_lock held. Drops a descriptor's use of file, true if it was the last one
+uint8_t fat_handle_file_put(fat_fs_t *fs, file_t *file)
+{
+    if (--file->opens > 0)
+        return 0;
+
+    for (int i=0; i < fs->file_count; i++) {
+        if (fs->files[i] == file) {
+            fs->files[i] = fs->files[--fs->file_count];
+            break;
+        }
+    }
+
+    return 1;
+}
+
+// Takes a reference, so a concurrent fat_close cannot free the handle under the caller
+fat_handle_t *fat_handle_get(fat_fs_t *fs, int fd)
+{
+    fat_handle_t *handle = NULL;
+
+    pthread_mutex_lock(&fs->handle_lock);
+    if (fd >= 0 && fd < fs->handle_count)
+        handle = fs->handles[fd];
+    if (handle != NULL)
+        handle->refs++;
+    pthread_mutex_unlock(&fs->handle_lock);
+
+    return handle;
+}
+
+// The last reference frees the handle, the last descriptor on its file closes that
+void fat_handle_put(fat_fs_t *fs, fat_handle_t *handle)
+{
+    uint8_t last;
+    uint8_t close = 0;
+
+    pthread_mutex_lock(&fs->handle_lock);
+    last = --handle->refs == 0;
+    if (last)
+        close = fat_handle_file_put(fs, handle->file);
+    pthread_mutex_unlock(&fs->handle_lock);
+    if (!last)
+        return;
+
+    if (close)
+        file_close(fs, handle->file);
+    pthread_mutex_destroy(&handle->lock);
+    free(handle);
+}
+
+// Split path into its parent directory and file name, then create it
+void fat_handle_create(fat_fs_t *fs, char *path)
+{
+    char *parent;
+    char *slash;
+
+    parent = strdup(path);
+    if (parent == NULL) {
+        puts("Malloc error: not enough space to copy path");
+        return;
+    }
+
+    slash = strrchr(parent, '/');
+    if (slash == NULL || slash[1] == '\0') {
+        free(parent);
+        return;
+    }
+    *slash = '\0';
+
+    file_create(fs, *parent == '\0' ? "/" : parent, slash + 1);
+    free(parent);
+}
+
+int fat_open(fat_fs_t *fs, char *path, uint32_t flags)
+{
+    fat_handle_t *handle;
+    file_t *shared = NULL;
+    file_t *file;
+    int fd;
+
+    if ((flags & FAT_O_ACCMODE) == FAT_O_ACCMODE)
+        return -1;
+
+    file = file_open_path(fs, path);
+    if (file == NULL && (flags & FAT_O_CREAT)) {
+        fat_handle_create(fs, path);
+        file = file_open_path(fs, path);
+    }
+    if (file == NULL)
+        return -1;
+
+    handle = malloc(sizeof(*handle));
+    if (handle == NULL) {
+        puts("Malloc error: not enough space to allocate file handle");
+        file_close(fs, file);
+        return -1;
+    }
+    handle->offset = 0;
+    handle->flags = flags;
+    // Empty cursor, the first lookup tries extent 0
+    handle->pos.index = 0;
+    handle->pos.cluster = 0;
+    handle->pos.length = 0;
+    handle->pos.extent = (size_t) -1;
+    handle->refs = 1;
+    pthread_mutex_init(&handle->lock, NULL);
+
+    // A file already open on the entry has the current size and chain, this copy may not
+    pthread_mutex_lock(&fs->handle_lock);
+    fd = fat_handle_slot(fs);
+    if (fd >= 0)
+        shared = fat_handle_file(fs, file);
+    if (shared != NULL) {
+        shared->opens++;
+        handle->file = shared;
+        fs->handles[fd] = handle;
+    } else {
+        fd = -1;
+    }
+    pthread_mutex_unlock(&fs->handle_lock);
+
+    if (shared != file)
+        file_close(fs, file);
+    if (fd < 0) {
+        pthread_mutex_destroy(&handle->lock);
+        free(handle);
+    }
+
+    return fd;
+}
+
+ssize_t fat_read(fat_fs_t *fs, int fd, void *buffer, size_t size)
+{
+    fat_handle_t *handle;
+    size_t done;
+
+    handle = fat_handle_get(fs, fd);
+    if (handle == NULL)
+        return -1;
+    if ((handle->flags & FAT_O_ACCMODE) == FAT_O_WRONLY) {
+        fat_handle_put(fs, handle);
+        return -1;
+    }
+
+    pthread_mutex_lock(&handle->lock);
+    done = file_read_at(handle->file, fs, &handle->pos, handle->offset, buffer, size);
+    handle->offset += done;
+    pthread_mutex_unlock(&handle->lock);
+    fat_handle_put(fs, handle);
+
+    return done;
+}
+
+ssize_t fat_write(fat_fs_t *fs, int fd, void *buffer, size_t size)
+{
+    fat_handle_t *handle;
+    file_t *file;
+    size_t done;
+
+    handle = fat_handle_get(fs, fd);
+    if (handle == NULL)
+        return -1;
+    if ((handle->flags & FAT_O_ACCMODE) == FAT_O_RDONLY) {
+        fat_handle_put(fs, handle);
+        return -1;
+    }
+    file = handle->file;
+
+    pthread_mutex_lock(&handle->lock);
+    if (handle->flags & FAT_O_APPEND) {
+        // The end of file is read under the same lock that moves it
+        fat_fs_lock_write(fs);
+        handle->offset = file->entry->size;
+        done = size == 0 ? 0 : file_grow_from(file, fs, &handle->pos, handle->offset, buffer, size);
+        fat_fs_unlock(fs);
+    } else {
+        done = file_write_at(file, fs, &handle->pos, handle->offset, buffer, size);
+    }
+    handle->offset += done;
+    pthread_mutex_unlock(&handle->lock);
+    fat_handle_put(fs, handle);
+
+    return done;
+}
+
+// New offset, -1 for a bad descriptor or whence, or one outside what FAT32 can address
+int64_t fat_lseek(fat_fs_t *fs, int fd, int64_t offset, int whence)
+{
+    fat_handle_t *handle;
+    int64_t base;
+
+    handle = fat_handle_get(fs, fd);
+    if (handle == NULL)
+        return -1;
+
+    pthread_mutex_lock(&handle->lock);
+    switch (whence) {
+    case SEEK_SET:
+        base = 0;
+        break;
+    case SEEK_CUR:
+        base = handle->offset;
+        break;
+    case SEEK_END:
+        fat_fs_lock_read(fs);
+        base = handle->file->entry->size;
+        fat_fs_unlock(fs);
+        break;
+    default:
+        pthread_mutex_unlock(&handle->lock);
+        fat_handle_put(fs, handle);
+        return -1;
+    }
+
+    // The cursor stays, a seek back into its extent still needs no lookup
+    if (base + offset < 0 || base + offset > UINT32_MAX) {
+        pthread_mutex_unlock(&handle->lock);
+        fat_handle_put(fs, handle);
+        return -1;
+    }
+    handle->offset = base + offset;
+    pthread_mutex_unlock(&handle->lock);
+    fat_handle_put(fs, handle);
+
+    return base + offset;
+}
+
+// Frees the descriptor at once, the handle goes with the last call still using it
+int fat_close(fat_fs_t *fs, int fd)
+{
+    fat_handle_t *handle = NULL;
+
+    pthread_mutex_lock(&fs->handle_lock);
+    if (fd >= 0 && fd < fs->handle_count) {
+        handle = fs->handles[fd];
+        fs->handles[fd] = NULL;
+    }
+    pthread_mutex_unlock(&fs->handle_lock);
+
+    if (handle == NULL)
+        return -1;
+
+    fat_handle_put(fs, handle);
+
+    return 0;
+}
+
+// Descriptors still open at unmount are closed
+void fat_handle_fini(fat_fs_t *fs)
+{
+    for (int fd=0; fd < fs->handle_count; fd++)
+        if (fs->handles[fd] != NULL)
+            fat_close(fs, fd);
+
+    free(fs->handles);
+    fs->handles = NULL;
+    fs->handle_count = 0;
+    free(fs->files);
+    fs->files = NULL;
+    fs->file_count = 0;
+    fs->file_capacity = 0;
+}
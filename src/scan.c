@@ -0,0 +1,146 @@
+#include <include/fat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_HAVE_X86
+#endif
+
+#define SCAN_BLOCK          64
+
+typedef uint64_t (*scan_block_fn)(const uint8_t *entries);
+
+// Bit i set when entry i of a block of SCAN_BLOCK on-disk entries is free.
+// The top 4 bits of a FAT32 entry are reserved and do not count
+uint64_t fat_scan_block_scalar(const uint8_t *entries)
+{
+    uint64_t mask = 0;
+
+    for (int i=0; i < SCAN_BLOCK; i++)
+        if ((BYTES_TO_LONG(entries, i * sizeof(uint32_t)) & FAT_ENTRY_MASK) == 0)
+            mask |= (uint64_t) 1 << i;
+
+    return mask;
+}
+
+#ifdef SCAN_HAVE_X86
+
+// Entries are little endian on disk as in memory, the vector paths load them as they are
+uint64_t fat_scan_block_sse2(const uint8_t *entries)
+{
+    const __m128i reserved = _mm_set1_epi32(FAT_ENTRY_MASK);
+    const __m128i zero = _mm_setzero_si128();
+    uint64_t mask = 0;
+    __m128i v;
+
+    for (int i=0; i < SCAN_BLOCK; i += 4) {
+        v = _mm_loadu_si128((const __m128i *) (entries + i * sizeof(uint32_t)));
+        v = _mm_cmpeq_epi32(_mm_and_si128(v, reserved), zero);
+        mask |= (uint64_t) _mm_movemask_ps(_mm_castsi128_ps(v)) << i;
+    }
+
+    return mask;
+}
+
+__attribute__((target("avx2")))
+uint64_t fat_scan_block_avx2(const uint8_t *entries)
+{
+    const __m256i reserved = _mm256_set1_epi32(FAT_ENTRY_MASK);
+    const __m256i zero = _mm256_setzero_si256();
+    uint64_t mask = 0;
+    __m256i v;
+
+    for (int i=0; i < SCAN_BLOCK; i += 8) {
+        v = _mm256_loadu_si256((const __m256i *) (entries + i * sizeof(uint32_t)));
+        v = _mm256_cmpeq_epi32(_mm256_and_si256(v, reserved), zero);
+        mask |= (uint64_t) _mm256_movemask_ps(_mm256_castsi256_ps(v)) << i;
+    }
+
+    return mask;
+}
+
+#endif
+
+scan_block_fn fat_scan_resolve(void)
+{
+#ifdef SCAN_HAVE_X86
+    if (__builtin_cpu_supports("avx2"))
+        return fat_scan_block_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return fat_scan_block_sse2;
+#endif
+
+    return fat_scan_block_scalar;
+}
+
+// Free mask of the block starting at entry base, bits outside [from, to) cleared
+uint64_t fat_scan_mask(scan_block_fn block, const uint8_t *entries, uint32_t base, uint32_t from, uint32_t to)
+{
+    uint64_t mask = 0;
+
+    if (base + SCAN_BLOCK <= to)
+        mask = block(entries + base * sizeof(uint32_t));
+    else
+        for (uint32_t i=base; i < to; i++)
+            if ((BYTES_TO_LONG(entries, i * sizeof(uint32_t)) & FAT_ENTRY_MASK) == 0)
+                mask |= (uint64_t) 1 << (i - base);
+
+    if (from > base)
+        mask &= ~(uint64_t) 0 << (from - base);
+
+    return mask;
+}
+
+// Free entries among entries [from, to) of a buffer of FAT sectors
+uint32_t fat_scan_count(const uint8_t *entries, uint32_t from, uint32_t to)
+{
+    scan_block_fn block = fat_scan_resolve();
+    uint32_t count = 0;
+
+    for (uint32_t base=from - from % SCAN_BLOCK; base < to; base += SCAN_BLOCK)
+        count += __builtin_popcountll(fat_scan_mask(block, entries, base, from, to));
+
+    return count;
+}
+
+// Index of the first free entry in [from, to), to when there is none
+uint32_t fat_scan_find(const uint8_t *entries, uint32_t from, uint32_t to)
+{
+    scan_block_fn block = fat_scan_resolve();
+    uint64_t mask;
+
+    for (uint32_t base=from - from % SCAN_BLOCK; base < to; base += SCAN_BLOCK) {
+        mask = fat_scan_mask(block, entries, base, from, to);
+        if (mask != 0)
+            return base + __builtin_ctzll(mask);
+    }
+
+    return to;
+}
+
+// Number of consecutive free entries from entry from, stopping at to
+uint32_t fat_scan_run(const uint8_t *entries, uint32_t from, uint32_t to)
+{
+    scan_block_fn block = fat_scan_resolve();
+    uint64_t used;
+    uint32_t end;
+
+    for (uint32_t base=from - from % SCAN_BLOCK; base < to; base += SCAN_BLOCK) {
+        end = base + SCAN_BLOCK < to ? base + SCAN_BLOCK : to;
+        used = ~fat_scan_mask(block, entries, base, base, end);
+        if (from > base)
+            used &= ~(uint64_t) 0 << (from - base);
+        if (used != 0)
+            return base + __builtin_ctzll(used) - from;
+    }
+
+    return to > from ? to - from : 0;
+}
+
+// Free masks of entries [0, to), one word per SCAN_BLOCK entries as in the cluster bitmap
+void fat_scan_masks(const uint8_t *entries, uint32_t to, uint64_t *masks)
+{
+    scan_block_fn block = fat_scan_resolve();
+
+    for (uint32_t base=0; base < to; base += SCAN_BLOCK)
+        masks[base / SCAN_BLOCK] = fat_scan_mask(block, entries, base, base, to);
+}
@@ -2,9 +2,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 
-#define FAT_CACHE_SIZE      10
+#define FAT_READAHEAD_SECTORS   8
+#define FAT_MIRROR_RUN          64
+#define FAT_SCAN_SECTORS        64
+#define FAT_SCAN_CACHED         8
+#define WORD_BITS               64
 
-fat_table_t *fat_table_init(fat_volume_t *volume)
+fat_table_t *fat_table_init(void)
 {
     fat_table_t *table;
 
@@ -13,85 +17,375 @@ fat_table_t *fat_table_init(fat_volume_t *volume)
         puts("Malloc error: not enough space to allocate fat table");
         return NULL;
     }
-
-    table->cache = cache_init(FAT_CACHE_SIZE, volume->sector_size, read_sector, write_sector);
-    if (table->cache == NULL) {
-        free(table);
-        return NULL;
-    }
+    table->bitmap = NULL;
+    table->lazy = 0;
+    table->mirror = 0;
+    table->mirror_dirty = NULL;
 
     return table;
 }
 
-void fat_table_fini(fat_table_t *table, fat_fs_t *fs)
+void fat_table_fini(fat_table_t *table)
 {
-    cache_flush(table->cache, fs);
-    cache_fini(table->cache);
+    if (table->bitmap != NULL)
+        fat_bitmap_fini(table->bitmap);
+    free(table->mirror_dirty);
     free(table);
 }
 
+uint8_t fat_table_mirror_init(fat_table_t *table)
+{
+    table->mirror_dirty = calloc((table->size + WORD_BITS - 1) / WORD_BITS, sizeof(*table->mirror_dirty));
+    if (table->mirror_dirty == NULL) {
+        puts("Malloc error: not enough space to allocate FAT mirror list");
+        return FS_ERROR;
+    }
+
+    return 0;
+}
+
+void fat_table_mirror_mark(fat_table_t *table, uint32_t sector)
+{
+    if (table->mirror_dirty != NULL)
+        table->mirror_dirty[sector / WORD_BITS] |= (uint64_t) 1 << (sector % WORD_BITS);
+}
+
+uint8_t fat_table_mirror_test(fat_table_t *table, uint32_t sector)
+{
+    if (table->mirror_dirty == NULL)
+        return 1;
+
+    return (table->mirror_dirty[sector / WORD_BITS] >> (sector % WORD_BITS)) & 1;
+}
+
+// Copy the FAT sectors written since the last pass to every other FAT, one run at a time
+void fat_table_mirror(fat_fs_t *fs)
+{
+    fat_table_t *table = fs->table;
+    size_t run_size = FAT_MIRROR_RUN * fs->volume->sector_size;
+    aio_batch_t batch[2];
+    aio_req_t *reqs;
+    uint8_t *buffer;
+    uint32_t sector;
+    uint32_t n;
+    int cur = 0;
+
+    if (!table->mirror)
+        return;
+
+    // Two buffers: copies of one run are written while the next run is read
+    buffer = malloc(2 * run_size);
+    reqs = malloc(2 * (table->count - 1) * sizeof(*reqs));
+    if (buffer == NULL || reqs == NULL) {
+        puts("Malloc error: not enough space to allocate FAT mirror buffer");
+        free(buffer);
+        free(reqs);
+        return;
+    }
+    aio_batch_init(&batch[0]);
+    aio_batch_init(&batch[1]);
+
+    for (sector=0; sector < table->size; sector += n) {
+        if (table->mirror_dirty != NULL && table->mirror_dirty[sector / WORD_BITS] == 0) {
+            n = WORD_BITS - sector % WORD_BITS;
+            continue;
+        }
+        if (!fat_table_mirror_test(table, sector)) {
+            n = 1;
+            continue;
+        }
+
+        for (n=1; n < FAT_MIRROR_RUN && sector + n < table->size && fat_table_mirror_test(table, sector + n); n++);
+
+        // The primary copy is brought up to date first and read back as one run
+        fat_fs_io_wait(fs, &batch[cur]);
+        if (cache_sync_range(fs->cache, fs, table->address + sector, n) != 0)
+            break;
+        if (read_sectors_into(fs, table->address + sector, n, buffer + cur * run_size) != 0)
+            break;
+        for (uint32_t k=1; k < table->count; k++)
+            write_sectors_submit(fs, table->address + k * table->size + sector, buffer + cur * run_size, n,
+                                 &reqs[cur * (table->count - 1) + k - 1], &batch[cur]);
+        cur ^= 1;
+
+        if (table->mirror_dirty != NULL)
+            for (uint32_t i=sector; i < sector + n; i++)
+                table->mirror_dirty[i / WORD_BITS] &= ~((uint64_t) 1 << (i % WORD_BITS));
+    }
+
+    fat_fs_io_wait(fs, &batch[0]);
+    fat_fs_io_wait(fs, &batch[1]);
+    free(buffer);
+    free(reqs);
+}
+
 uint32_t fat_table_access(fat_fs_t *fs, uint32_t cluster, uint32_t data, uint8_t mode)
 {
     uint32_t offset;
+    uint32_t sector;
 
     offset = cluster * sizeof(uint32_t);
     if (fs->table->size * fs->volume->sector_size <= offset)
         return READ_ERROR;
 
-    if (mode == FAT_READ)
-        return cache_readl(fs->table->cache, fs, fs->table->address, offset);
-    else if (mode == FAT_WRITE)
-        cache_writel(fs->table->cache, fs, fs->table->address, offset, data);
+    if (mode == FAT_READ) {
+        // Chain walks tend to stay close, a miss pulls in the neighbouring FAT sectors
+        sector = offset / fs->volume->sector_size;
+        if (!cache_contains(fs->cache, fs->table->address + sector))
+            cache_prefetch(fs->cache, fs, fs->table->address + sector,
+                           fs->table->size - sector < FAT_READAHEAD_SECTORS ? fs->table->size - sector : FAT_READAHEAD_SECTORS);
+        return cache_readl(fs->cache, fs, fs->table->address, offset);
+    }
+    else if (mode == FAT_WRITE) {
+        cache_writel(fs->cache, fs, fs->table->address, offset, data);
+        fat_table_mirror_mark(fs->table, offset / fs->volume->sector_size);
+    }
 
     return 0;
 }
 
 uint32_t fat_table_read(fat_fs_t *fs, uint32_t cluster)
 {
+    FS_STAT_ADD(fs, fat_reads, 1);
     return fat_table_access(fs, cluster, 0, FAT_READ);
 }
 
 void fat_table_write(fat_fs_t *fs, uint32_t cluster, uint32_t content)
 {
-    fat_table_access(fs, cluster, content, FAT_WRITE);
+    fat_bitmap_t *bitmap = fs->table->bitmap;
+    uint32_t old = 0;
+
+    FS_STAT_ADD(fs, fat_writes, 1);
+    // Without the bitmap the free count follows every entry that changes state
+    if (bitmap == NULL && fs->info.free_cluster_count != UNKNOWN_FREE_CLUSTER)
+        old = fat_table_access(fs, cluster, 0, FAT_READ);
+    if (fat_table_access(fs, cluster, content, FAT_WRITE) == READ_ERROR)
+        return;
+
+    if (bitmap != NULL) {
+        fat_bitmap_set(bitmap, cluster, (content & FAT_ENTRY_MASK) == 0);
+        fs->info.free_cluster_count = bitmap->free_count;
+    } else if (fs->info.free_cluster_count != UNKNOWN_FREE_CLUSTER) {
+        if ((old & FAT_ENTRY_MASK) == 0 && (content & FAT_ENTRY_MASK) != 0)
+            fs->info.free_cluster_count--;
+        else if ((old & FAT_ENTRY_MASK) != 0 && (content & FAT_ENTRY_MASK) == 0)
+            fs->info.free_cluster_count++;
+    }
+}
+
+// Build the free cluster bitmap, at mount or on the first allocation when deferred.
+// Hints FSInfo could not provide are worked out here as well
+void fat_table_bitmap_load(fat_fs_t *fs)
+{
+    fat_table_t *table = fs->table;
+
+    table->lazy = 0;
+    table->bitmap = fat_bitmap_init(fs);
+    if (table->bitmap != NULL)
+        fs->info.free_cluster_count = table->bitmap->free_count;
+    else if (fs->info.free_cluster_count == UNKNOWN_FREE_CLUSTER)
+        fs->info.free_cluster_count = free_cluster_count_read(fs);
+    if (fs->info.free_cluster == UNKNOWN_FREE_CLUSTER)
+        fs->info.free_cluster = first_free_cluster_read(fs);
+}
+
+// Read n FAT sectors from sector on, through the cache when a single one is wanted
+uint8_t fat_table_load(fat_fs_t *fs, uint32_t sector, uint32_t n, uint8_t *buffer)
+{
+    uint32_t lba = fs->table->address + sector;
+
+    if (n == 1)
+        return cache_span(fs->cache, fs, lba, 0, buffer, fs->volume->sector_size, CACHE_READ);
+
+    if (cache_sync_range(fs->cache, fs, lba, n) != 0)
+        return FS_ERROR;
+    return read_sectors_into(fs, lba, n, buffer);
 }
 
 uint32_t free_cluster_count_read(fat_fs_t *fs)
 {
-    uint32_t count = fs->info.root_cluster;
+    uint32_t per_sector = fs->volume->sector_size / sizeof(uint32_t);
+    uint32_t max = fs->volume->cluster_count + 2;
+    uint32_t count = 0;
+    uint32_t first;
+    uint8_t *buffer;
+    uint32_t n;
+
+    if (fs->table->bitmap != NULL)
+        return fs->table->bitmap->free_count;
+
+    buffer = malloc(FAT_SCAN_SECTORS * fs->volume->sector_size);
+    if (buffer == NULL) {
+        puts("Malloc error: not enough space to allocate FAT scan buffer");
+        return UNKNOWN_FREE_CLUSTER;
+    }
+
+    // Whole batches of sectors go through the vector scanner
+    for (uint32_t sector=0; sector < fs->table->size && sector * per_sector < max; sector += n) {
+        n = fs->table->size - sector < FAT_SCAN_SECTORS ? fs->table->size - sector : FAT_SCAN_SECTORS;
+        if (fat_table_load(fs, sector, n, buffer) != 0) {
+            count = UNKNOWN_FREE_CLUSTER;
+            break;
+        }
 
-    for (uint32_t i=count; i < fs->volume->cluster_count; i++) {
-        if (fat_table_read(fs, i) == 0) 
-            count++;
+        first = sector * per_sector;
+        count += fat_scan_count(buffer, first < 2 ? 2 - first : 0,
+                                max - first < n * per_sector ? max - first : n * per_sector);
     }
 
+    free(buffer);
     return count;
 }
 
+// First free run in [start, end), capped at count clusters; 0 when there is none.
+// The first sectors come through the cache, allocation mostly finds space there
+uint32_t fat_table_find_free(fat_fs_t *fs, uint32_t start, uint32_t end, uint32_t count, uint32_t *len, uint8_t *buffer)
+{
+    uint32_t per_sector = fs->volume->sector_size / sizeof(uint32_t);
+    uint32_t first = 0;
+    uint32_t base;
+    uint32_t from;
+    uint32_t to;
+    uint32_t run;
+    uint32_t n;
+
+    *len = 0;
+    for (uint32_t sector=start / per_sector, k=0; sector < fs->table->size && sector * per_sector < end; sector += n, k++) {
+        n = k < FAT_SCAN_CACHED ? 1 : FAT_SCAN_SECTORS;
+        if (n > fs->table->size - sector)
+            n = fs->table->size - sector;
+        if (fat_table_load(fs, sector, n, buffer) != 0)
+            break;
+
+        base = sector * per_sector;
+        to = end - base < n * per_sector ? end - base : n * per_sector;
+
+        // A run reaching the end of the previous batch may go on here
+        if (*len > 0) {
+            run = fat_scan_run(buffer, 0, to);
+            *len += run;
+            if (*len >= count || run < to)
+                break;
+            continue;
+        }
+
+        from = fat_scan_find(buffer, start > base ? start - base : 0, to);
+        if (from == to)
+            continue;
+        first = base + from;
+        run = fat_scan_run(buffer, from, to);
+        *len = run;
+        if (*len >= count || from + run < to)
+            break;
+    }
+
+    if (*len > count)
+        *len = count;
+
+    return first;
+}
+
+// Free run search without the bitmap, from start to the end of the FAT and then from the beginning
+uint32_t fat_table_find_run(fat_fs_t *fs, uint32_t start, uint32_t count, uint32_t *len)
+{
+    uint32_t max = fs->volume->cluster_count + 2;
+    uint32_t first;
+    uint8_t *buffer;
+
+    *len = 0;
+    buffer = malloc(FAT_SCAN_SECTORS * fs->volume->sector_size);
+    if (buffer == NULL) {
+        puts("Malloc error: not enough space to allocate FAT scan buffer");
+        return 0;
+    }
+
+    if (start < 2 || start >= max)
+        start = 2;
+    first = fat_table_find_free(fs, start, max, count, len, buffer);
+    if (first == 0 && start > 2)
+        first = fat_table_find_free(fs, 2, start, count, len, buffer);
+
+    free(buffer);
+    return first;
+}
+
 uint32_t first_free_cluster_read(fat_fs_t *fs)
 {
-    uint32_t i;
+    uint32_t len;
 
-    i = fs->info.root_cluster;
-    while (fat_table_read(fs, i) != 0 && i++ < fs->volume->cluster_count);
+    if (fs->table->bitmap != NULL)
+        return fat_bitmap_find(fs->table->bitmap, fs->info.root_cluster);
 
-    return i;
+    return fat_table_find_run(fs, fs->info.root_cluster, 1, &len);
 }
 
 uint32_t fat_table_alloc_cluster(fat_fs_t *fs, uint32_t content)
 {
+    uint32_t cluster;
+    uint32_t len;
+
+    if (fs->table->lazy)
+        fat_table_bitmap_load(fs);
     if (fs->info.free_cluster_count == 0)
         return CLUSTER_ALLOC_ERR;
-    
-    for (uint32_t i=fs->info.free_cluster; i < fs->volume->cluster_count; i++)
-        if (fat_table_read(fs, i) == 0) {
-            fat_table_write(fs, i, content);
-            fs->info.free_cluster_count--;
-            fs->info.free_cluster = i;
-            return i;
-        }
 
-    return CLUSTER_ALLOC_ERR;
+    if (fs->table->bitmap != NULL)
+        cluster = fat_bitmap_find(fs->table->bitmap, fs->info.free_cluster);
+    else
+        cluster = fat_table_find_run(fs, fs->info.free_cluster, 1, &len);
+    if (cluster == 0)
+        return CLUSTER_ALLOC_ERR;
+
+    fat_table_write(fs, cluster, content);
+    fs->info.free_cluster = cluster;
+    return cluster;
+}
+
+// Allocate up to count contiguous clusters, chained after prev when it is not 0
+uint32_t fat_table_alloc_run(fat_fs_t *fs, uint32_t prev, uint32_t count, uint32_t *len)
+{
+    fat_bitmap_t *bitmap;
+    uint32_t first;
+
+    *len = 0;
+    if (fs->table->lazy)
+        fat_table_bitmap_load(fs);
+    if (count == 0 || fs->info.free_cluster_count == 0)
+        return CLUSTER_ALLOC_ERR;
+
+    bitmap = fs->table->bitmap;
+    if (bitmap == NULL)
+        first = fat_table_find_run(fs, fs->info.free_cluster, count, len);
+    else if (prev >= 2 && fat_bitmap_test(bitmap, prev + 1)) {
+        // Growing in place keeps the file in a single extent
+        first = prev + 1;
+        *len = fat_bitmap_run(bitmap, first, count);
+    } else
+        first = fat_bitmap_find_run(bitmap, fs->info.free_cluster, count, len);
+    if (first == 0)
+        return CLUSTER_ALLOC_ERR;
+
+    for (uint32_t i=0; i + 1 < *len; i++)
+        fat_table_write(fs, first + i, first + i + 1);
+    fat_table_write(fs, first + *len - 1, EOC1);
+    fs->info.free_cluster = first + *len - 1;
+
+    if (prev >= 2)
+        fat_table_write(fs, prev, first);
+
+    return first;
+}
+
+void cluster_chain_free(fat_fs_t *fs, uint32_t start)
+{
+    uint32_t next;
+
+    for (uint32_t n=0; start >= 2 && start < EOC1 && n < fs->volume->cluster_count; n++) {
+        next = fat_table_read(fs, start) & FAT_ENTRY_MASK;
+        FS_STAT_ADD(fs, chain_steps, 1);
+        fat_table_write(fs, start, 0);
+        start = next;
+    }
 }
 
 uint32_t cluster_chain_get_len(fat_fs_t *fs, uint32_t start)
@@ -99,10 +393,12 @@ uint32_t cluster_chain_get_len(fat_fs_t *fs, uint32_t start)
     uint32_t curr;
     uint32_t len = 0;
 
+    curr = start;
     do {
-        curr = fat_table_read(fs, start);
+        curr = fat_table_read(fs, curr) & FAT_ENTRY_MASK;
+        FS_STAT_ADD(fs, chain_steps, 1);
         len++;
-    } while (curr != EOC1 && curr != EOC2 && curr != READ_ERROR);
+    } while (curr >= 2 && curr < EOC1 && len <= fs->volume->cluster_count);
 
     return len;
 }
@@ -114,6 +410,7 @@ uint32_t cluster_chain_read(fat_fs_t *fs, uint32_t curr, uint32_t index)
     do {
         ret = curr;
         curr = fat_table_read(fs, curr);
+        FS_STAT_ADD(fs, chain_steps, 1);
     } while (index-- && curr != EOC1 && curr != EOC2);
 
     return ret;